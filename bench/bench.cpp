@@ -0,0 +1,175 @@
+// Times each rpl2elf conversion stage separately over a set of inputs.
+//
+// Every input is converted --iterations times, the min, median and mean
+// time of each stage are reported per input.
+#include "decompressor.h"
+#include "parallel.h"
+#include "rpl2elf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <excmd.h>
+#include <filesystem>
+#include <fmt/format.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct BenchOptions
+{
+	bool map = false;
+	DecompressorType decompressorType = DecompressorType::Zlib;
+	unsigned jobs = 1;
+	unsigned iterations = 10;
+	std::string output;
+};
+
+struct Stage
+{
+	const char *name;
+	std::function<bool(Rpl &)> run;
+	std::vector<double> times;
+};
+
+/**
+ * Print min / median / mean of a set of timings in milliseconds.
+ */
+static void
+printTimes(const char *name,
+			  std::vector<double> times)
+{
+	std::sort(times.begin(), times.end());
+
+	auto mean = 0.0;
+	for (auto time : times) {
+		mean += time;
+	}
+
+	mean /= times.size();
+	fmt::print("  {:<24} {:>10.3f} {:>10.3f} {:>10.3f}\n", name, times.front(), times[times.size() / 2], mean);
+}
+
+/**
+ * Run every stage on path options.iterations times.
+ */
+static bool
+benchFile(const std::string &path,
+			 const BenchOptions &options)
+{
+	std::vector<Stage> stages = {
+		{ "readRpl", [&](Rpl &rpl) { return readRpl(rpl, path, options.map, options.decompressorType, options.jobs); }, {} },
+		{ "decodeTables", decodeTables, {} },
+		{ "fixFileHeader", fixFileHeader, {} },
+		{ "fixRelocations", fixRelocations, {} },
+		{ "relocateImports", relocateImports, {} },
+		{ "encodeTables", encodeTables, {} },
+		{ "calculateSectionOffsets", calculateSectionOffsets, {} },
+		{ "writeElf", [&](Rpl &rpl) { return writeElf(rpl, options.output); }, {} },
+	};
+	std::vector<double> totals;
+
+	for (auto i = 0u; i < options.iterations; ++i) {
+		auto rpl = Rpl {};
+		auto total = 0.0;
+
+		for (auto &stage : stages) {
+			auto start = std::chrono::steady_clock::now();
+			auto result = stage.run(rpl);
+			auto time = std::chrono::duration<double, std::milli> { std::chrono::steady_clock::now() - start }.count();
+
+			if (!result) {
+				fmt::print("{}: {} failed\n", path, stage.name);
+				return false;
+			}
+
+			stage.times.push_back(time);
+			total += time;
+		}
+
+		totals.push_back(total);
+	}
+
+	fmt::print("{} ({} iterations, ms)\n", path, options.iterations);
+	fmt::print("  {:<24} {:>10} {:>10} {:>10}\n", "stage", "min", "median", "mean");
+
+	for (auto &stage : stages) {
+		printTimes(stage.name, stage.times);
+	}
+
+	printTimes("total", totals);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	excmd::parser parser;
+	excmd::option_state options;
+	using excmd::description;
+	using excmd::value;
+
+	try {
+		parser.global_options()
+			.add_option("H,help",
+							description { "Show help." })
+			.add_option("mmap",
+							description { "Map the input file into memory instead of reading it." })
+			.add_option("j,jobs",
+							description { "Number of threads used to decompress sections." },
+							value<unsigned> {})
+			.add_option("inflate",
+							description { "Decompression engine used for compressed sections." },
+							value<std::string> {},
+							excmd::allowed<std::string> { availableDecompressors() },
+							excmd::default_value<std::string> { "zlib" })
+			.add_option("n,iterations",
+							description { "Number of times each input is converted." },
+							value<unsigned> {})
+			.add_option("o,output",
+							description { "Path the converted .elf is written to." },
+							value<std::string> {});
+
+		parser.default_command()
+			.add_argument("src",
+							  description { "Path to input rpl file" },
+							  value<std::string> {});
+
+		options = parser.parse(argc, argv);
+	} catch (excmd::exception ex) {
+		fmt::print("Error parsing options: {}\n", ex.what());
+		return -1;
+	}
+
+	if (options.empty() || options.has("help") || !options.has("src")) {
+		fmt::print("{} <options> src...\n", argv[0]);
+		fmt::print("{}\n", parser.format_help(argv[0]));
+		return 0;
+	}
+
+	auto benchOptions = BenchOptions {};
+	benchOptions.map = options.has("mmap");
+	benchOptions.jobs = options.has("jobs") ? options.get<unsigned>("jobs") : default_job_count();
+
+	if (options.has("iterations")) {
+		benchOptions.iterations = std::max(1u, options.get<unsigned>("iterations"));
+	}
+
+	if (options.has("inflate")) {
+		parseDecompressorType(options.get<std::string>("inflate"), benchOptions.decompressorType);
+	}
+
+	if (options.has("output")) {
+		benchOptions.output = options.get<std::string>("output");
+	} else {
+		benchOptions.output = (std::filesystem::temp_directory_path() / "rpl2elf_bench.elf").string();
+	}
+
+	auto paths = options.extra_arguments;
+	paths.insert(paths.begin(), options.get<std::string>("src"));
+
+	auto result = true;
+	for (auto &path : paths) {
+		result &= benchFile(path, benchOptions);
+	}
+
+	return result ? 0 : -1;
+}
@@ -0,0 +1,502 @@
+// Synthetic .rpx / .rpl generator for benchmarking rpl2elf.
+//
+// The same options and seed always produce the same file, so a corpus can
+// be regenerated anywhere instead of being checked in.
+#include "elf.h"
+
+#include <excmd.h>
+#include <fmt/format.h>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+struct GeneratorOptions
+{
+	uint32_t seed = 1;
+	uint32_t sections = 3;
+	uint32_t sectionSize = 0x10000;
+	uint32_t symbols = 1000;
+	uint32_t relocations = 1000;
+	uint32_t imports = 2;
+	double ghsPairs = 0.3;
+	double entropy = 0.3;
+	int level = 6;
+	bool rpx = true;
+};
+
+struct GeneratedSection
+{
+	std::string name;
+	elf::SectionHeader header;
+	std::vector<char> data;
+};
+
+class Generator
+{
+	// Address range of a section symbols and relocations can point into
+	struct Region
+	{
+		uint32_t index;
+		uint32_t addr;
+		uint32_t size;
+	};
+
+public:
+	Generator(const GeneratorOptions &options) :
+		mOptions(options),
+		mRandom(options.seed)
+	{
+	}
+
+	bool
+	write(const std::string &path)
+	{
+		generate();
+		return writeFile(path);
+	}
+
+private:
+	uint32_t
+	random(uint32_t count)
+	{
+		return count ? static_cast<uint32_t>(mRandom() % count) : 0;
+	}
+
+	bool
+	chance(double probability)
+	{
+		return (mRandom() & 0xFFFFFF) < probability * 0x1000000;
+	}
+
+	uint32_t
+	addSection(const std::string &name,
+				  uint32_t type,
+				  uint32_t flags,
+				  uint32_t addr,
+				  uint32_t addralign)
+	{
+		auto &section = mSections.emplace_back();
+		section.name = name;
+		section.header.name = 0u;
+		section.header.type = type;
+		section.header.flags = flags;
+		section.header.addr = addr;
+		section.header.offset = 0u;
+		section.header.size = 0u;
+		section.header.link = 0u;
+		section.header.info = 0u;
+		section.header.addralign = addralign;
+		section.header.entsize = 0u;
+		return static_cast<uint32_t>(mSections.size() - 1);
+	}
+
+	// Section contents where a fraction of the bytes is random, the rest
+	// zero, so the entropy option controls how well sections compress
+	std::vector<char>
+	contents(uint32_t size)
+	{
+		std::vector<char> data(size, 0);
+
+		for (auto &byte : data) {
+			if (chance(mOptions.entropy)) {
+				byte = static_cast<char>(mRandom());
+			}
+		}
+
+		return data;
+	}
+
+	void
+	generate()
+	{
+		std::vector<Region> regions;
+		auto textAddr = 0x02000000u;
+		auto dataAddr = 0x10000000u;
+
+		addSection("", elf::SHT_NULL, 0, 0, 0);
+
+		// Content sections, cycling through text, data and read only data
+		for (auto i = 0u; i < mOptions.sections; ++i) {
+			auto suffix = i / 3 ? fmt::format(".{}", i / 3) : std::string {};
+			auto size = mOptions.sectionSize;
+			auto index = 0u;
+
+			switch (i % 3) {
+			case 0:
+				index = addSection(".text" + suffix, elf::SHT_PROGBITS, elf::SHF_ALLOC | elf::SHF_EXECINSTR, textAddr, 32);
+				textAddr += align_up(size, 32);
+				break;
+			case 1:
+				index = addSection(".data" + suffix, elf::SHT_PROGBITS, elf::SHF_ALLOC | elf::SHF_WRITE, dataAddr, 32);
+				dataAddr += align_up(size, 32);
+				break;
+			default:
+				index = addSection(".rodata" + suffix, elf::SHT_PROGBITS, elf::SHF_ALLOC, dataAddr, 32);
+				dataAddr += align_up(size, 32);
+			}
+
+			mSections[index].data = contents(size);
+			regions.push_back({ index, mSections[index].header.addr, size });
+		}
+
+		auto bss = addSection(".bss", elf::SHT_NOBITS, elf::SHF_ALLOC | elf::SHF_WRITE, dataAddr, 64);
+		mSections[bss].header.size = 0x1000u;
+
+		// Import sections live at the loader addresses relocateImports moves
+		auto importAddr = 0xC0000000u;
+		for (auto i = 0u; i < mOptions.imports; ++i) {
+			auto library = fmt::format("library{}", i);
+			auto index = addSection(".fimport_" + library, elf::SHT_RPL_IMPORTS, elf::SHF_ALLOC | elf::SHF_EXECINSTR, importAddr, 16);
+			auto functions = 4u;
+			auto &data = mSections[index].data;
+
+			data.resize(align_up(8 + library.size() + 1, 8) + functions * 8);
+			auto import = reinterpret_cast<elf::RplImport *>(data.data());
+			import->count = functions;
+			import->signature = static_cast<uint32_t>(mRandom());
+			std::memcpy(import->name, library.c_str(), library.size());
+
+			regions.push_back({ index, importAddr, static_cast<uint32_t>(data.size()) });
+			importAddr += align_up(static_cast<uint32_t>(data.size()), 16);
+		}
+
+		auto symtab = addSection(".symtab", elf::SHT_SYMTAB, elf::SHF_ALLOC, 0, 4);
+		auto strtab = addSection(".strtab", elf::SHT_STRTAB, elf::SHF_ALLOC, 0, 1);
+		generateSymbols(symtab, strtab, regions);
+
+		for (auto i = 0u; i < mOptions.sections; ++i) {
+			auto &region = regions[i];
+			auto index = addSection(".rela" + mSections[region.index].name, elf::SHT_RELA, 0, 0, 4);
+			mSections[index].header.link = symtab;
+			mSections[index].header.info = region.index;
+			mSections[index].header.entsize = static_cast<uint32_t>(sizeof(elf::Rela));
+			generateRelocations(index, region.addr, region.size);
+		}
+
+		auto shstrtab = addSection(".shstrtab", elf::SHT_STRTAB, elf::SHF_ALLOC, 0, 1);
+		auto crcs = addSection("", elf::SHT_RPL_CRCS, 0, 0, 4);
+		auto fileInfo = addSection("", elf::SHT_RPL_FILEINFO, 0, 0, 4);
+		mSections[crcs].header.entsize = 4u;
+		mShStrNdx = shstrtab;
+
+		// Names, then the CRCs of every section's uncompressed contents
+		auto &names = mSections[shstrtab].data;
+		names.push_back(0);
+
+		for (auto &section : mSections) {
+			if (!section.name.empty()) {
+				section.header.name = static_cast<uint32_t>(names.size());
+				names.insert(names.end(), section.name.begin(), section.name.end());
+				names.push_back(0);
+			}
+		}
+
+		generateFileInfo(fileInfo, textAddr - 0x02000000u, dataAddr - 0x10000000u);
+
+		auto &crcData = mSections[crcs].data;
+		crcData.resize(mSections.size() * sizeof(elf::RplCrc));
+
+		for (auto i = 0u; i < mSections.size(); ++i) {
+			auto &data = mSections[i].data;
+			auto crc = i == crcs ? 0u : static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef *>(data.data()), static_cast<uInt>(data.size())));
+			reinterpret_cast<elf::RplCrc *>(crcData.data())[i].crc = crc;
+		}
+	}
+
+	void
+	generateSymbols(uint32_t symtab,
+						 uint32_t strtab,
+						 const std::vector<Region> &regions)
+	{
+		static const uint8_t types[] = {
+			elf::STT_NOTYPE, elf::STT_OBJECT, elf::STT_FUNC, elf::STT_SECTION, elf::STT_FILE,
+		};
+
+		auto &strings = mSections[strtab].data;
+		auto &data = mSections[symtab].data;
+		strings.push_back(0);
+
+		mSections[symtab].header.link = strtab;
+		mSections[symtab].header.entsize = static_cast<uint32_t>(sizeof(elf::Symbol));
+		data.resize((mOptions.symbols + 1) * sizeof(elf::Symbol));
+		auto symbols = reinterpret_cast<elf::Symbol *>(data.data());
+		std::memset(data.data(), 0, data.size());
+
+		for (auto i = 1u; i <= mOptions.symbols; ++i) {
+			auto &region = regions[random(static_cast<uint32_t>(regions.size()))];
+			auto name = fmt::format("symbol{}", i);
+
+			symbols[i].name = static_cast<uint32_t>(strings.size());
+			symbols[i].value = region.addr + random(region.size + 1);
+			symbols[i].size = 4u;
+			symbols[i].info = static_cast<uint8_t>((elf::STB_GLOBAL << 4) | types[random(5)]);
+			symbols[i].other = uint8_t { 0 };
+			symbols[i].shndx = static_cast<uint16_t>(region.index);
+			strings.insert(strings.end(), name.begin(), name.end());
+			strings.push_back(0);
+		}
+	}
+
+	void
+	generateRelocations(uint32_t index,
+							  uint32_t addr,
+							  uint32_t size)
+	{
+		static const uint8_t types[] = {
+			elf::R_PPC_ADDR32, elf::R_PPC_ADDR16_LO, elf::R_PPC_ADDR16_HI, elf::R_PPC_ADDR16_HA,
+			elf::R_PPC_REL24, elf::R_PPC_REL14, elf::R_PPC_EMB_SDA21, elf::R_PPC_EMB_RELSDA,
+		};
+
+		struct Relocation
+		{
+			uint32_t offset;
+			uint32_t info;
+			int32_t addend;
+		};
+
+		std::vector<Relocation> relocations;
+		relocations.reserve(mOptions.relocations + 1);
+
+		while (relocations.size() < mOptions.relocations) {
+			auto symbol = 1 + random(mOptions.symbols);
+			auto offset = addr + (random(std::max(size, 4u) - 3) & ~1u);
+			auto addend = static_cast<int32_t>(random(2000)) - 1000;
+
+			if (chance(mOptions.ghsPairs)) {
+				relocations.push_back({ offset, (symbol << 8) | elf::R_PPC_GHS_REL16_HI, addend });
+				relocations.push_back({ offset + 2, (symbol << 8) | elf::R_PPC_GHS_REL16_LO, addend + 2 });
+			} else {
+				relocations.push_back({ offset, (symbol << 8) | types[random(8)], addend });
+			}
+		}
+
+		// Real tables are not sorted, and pair halves are rarely adjacent
+		for (auto i = relocations.size(); i > 1; --i) {
+			std::swap(relocations[i - 1], relocations[random(static_cast<uint32_t>(i))]);
+		}
+
+		auto &data = mSections[index].data;
+		data.resize(relocations.size() * sizeof(elf::Rela));
+		auto rels = reinterpret_cast<elf::Rela *>(data.data());
+
+		for (auto i = 0u; i < relocations.size(); ++i) {
+			rels[i].offset = relocations[i].offset;
+			rels[i].info = relocations[i].info;
+			rels[i].addend = relocations[i].addend;
+		}
+	}
+
+	void
+	generateFileInfo(uint32_t index,
+						  uint32_t textSize,
+						  uint32_t dataSize)
+	{
+		auto &data = mSections[index].data;
+		data.resize(sizeof(elf::RplFileInfo), 0);
+
+		auto info = reinterpret_cast<elf::RplFileInfo *>(data.data());
+		info->version = 0xCAFE0402u;
+		info->textSize = textSize;
+		info->textAlign = 32u;
+		info->dataSize = dataSize;
+		info->dataAlign = 4096u;
+		info->loadSize = 0u;
+		info->loadAlign = 4u;
+		info->tempSize = 0u;
+		info->trampAdjust = 0u;
+		info->sdaBase = 0u;
+		info->sda2Base = 0u;
+		info->stackSize = 0x10000u;
+		info->filename = 0u;
+		info->flags = mOptions.rpx ? uint32_t { elf::RPL_IS_RPX } : 0u;
+	}
+
+	// Contents of a section as stored in the file, compressed sections are
+	// prefixed with their inflated size
+	std::vector<char>
+	encode(GeneratedSection &section)
+	{
+		auto type = static_cast<uint32_t>(section.header.type);
+
+		if (!mOptions.level ||
+			 section.data.empty() ||
+			 type == elf::SHT_RPL_CRCS ||
+			 type == elf::SHT_RPL_FILEINFO) {
+			return section.data;
+		}
+
+		auto size = compressBound(static_cast<uLong>(section.data.size()));
+		std::vector<char> body(sizeof(uint32_t) + size);
+		compress2(reinterpret_cast<Bytef *>(body.data() + sizeof(uint32_t)), &size,
+					 reinterpret_cast<const Bytef *>(section.data.data()),
+					 static_cast<uLong>(section.data.size()),
+					 mOptions.level);
+
+		*reinterpret_cast<be_val<uint32_t> *>(body.data()) = static_cast<uint32_t>(section.data.size());
+		body.resize(sizeof(uint32_t) + size);
+		section.header.flags = section.header.flags | elf::SHF_DEFLATED;
+		return body;
+	}
+
+	bool
+	writeFile(const std::string &path)
+	{
+		elf::Header header;
+		std::memset(&header, 0, sizeof(header));
+		header.magic = elf::HeaderMagic;
+		header.fileClass = uint8_t { 1 };
+		header.encoding = uint8_t { 2 };
+		header.elfVersion = uint8_t { 1 };
+		header.abi = uint16_t { elf::EABI_CAFE };
+		header.type = uint16_t { elf::ET_CAFE_RPL };
+		header.machine = uint16_t { elf::EM_PPC };
+		header.version = 1u;
+		header.entry = 0x02000000u;
+		header.shoff = 0x40u;
+		header.ehsize = static_cast<uint16_t>(sizeof(elf::Header));
+		header.shentsize = static_cast<uint16_t>(sizeof(elf::SectionHeader));
+		header.shnum = static_cast<uint16_t>(mSections.size());
+		header.shstrndx = static_cast<uint16_t>(mShStrNdx);
+
+		std::vector<std::vector<char>> bodies;
+		auto offset = align_up(0x40u + static_cast<uint32_t>(mSections.size() * sizeof(elf::SectionHeader)), 64);
+
+		for (auto &section : mSections) {
+			bodies.push_back(encode(section));
+
+			if (section.header.type != elf::SHT_NOBITS) {
+				section.header.size = static_cast<uint32_t>(bodies.back().size());
+				section.header.offset = bodies.back().empty() ? 0u : offset;
+				offset += static_cast<uint32_t>(bodies.back().size());
+			}
+		}
+
+		std::ofstream out { path, std::ofstream::binary };
+		if (!out.is_open()) {
+			fmt::print("Could not open {} for writing\n", path);
+			return false;
+		}
+
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+		for (auto &section : mSections) {
+			out.seekp(0x40 + getIndex(section) * sizeof(elf::SectionHeader));
+			out.write(reinterpret_cast<const char *>(&section.header), sizeof(elf::SectionHeader));
+
+			if (!bodies[getIndex(section)].empty()) {
+				out.seekp(static_cast<uint32_t>(section.header.offset));
+				out.write(bodies[getIndex(section)].data(), bodies[getIndex(section)].size());
+			}
+		}
+
+		if (!out) {
+			fmt::print("Could not write {}\n", path);
+			return false;
+		}
+
+		return true;
+	}
+
+	size_t
+	getIndex(const GeneratedSection &section) const
+	{
+		return static_cast<size_t>(&section - &mSections[0]);
+	}
+
+private:
+	GeneratorOptions mOptions;
+	std::mt19937 mRandom;
+	std::vector<GeneratedSection> mSections;
+	uint32_t mShStrNdx = 0;
+};
+
+int main(int argc, char **argv)
+{
+	excmd::parser parser;
+	excmd::option_state options;
+	using excmd::description;
+	using excmd::value;
+
+	try {
+		parser.global_options()
+			.add_option("H,help",
+							description { "Show help." })
+			.add_option("seed",
+							description { "Random seed, the same seed and options give the same file." },
+							value<uint32_t> {})
+			.add_option("sections",
+							description { "Number of text, data and read only data sections." },
+							value<uint32_t> {})
+			.add_option("section-size",
+							description { "Size in bytes of each of those sections." },
+							value<uint32_t> {})
+			.add_option("symbols",
+							description { "Number of symbols." },
+							value<uint32_t> {})
+			.add_option("relocations",
+							description { "Number of relocations for each section." },
+							value<uint32_t> {})
+			.add_option("imports",
+							description { "Number of import sections." },
+							value<uint32_t> {})
+			.add_option("ghs-pairs",
+							description { "Fraction of relocations emitted as GHS_REL16_HI / LO pairs." },
+							value<double> {})
+			.add_option("entropy",
+							description { "Fraction of random bytes in section contents, 0 compresses best and 1 does not compress." },
+							value<double> {})
+			.add_option("level",
+							description { "zlib compression level, 0 writes every section uncompressed." },
+							value<int> {})
+			.add_option("rpl",
+							description { "Generate an .rpl library instead of an .rpx." });
+
+		parser.default_command()
+			.add_argument("dst",
+							  description { "Path to output rpx file" },
+							  value<std::string> {});
+
+		options = parser.parse(argc, argv);
+	} catch (excmd::exception ex) {
+		fmt::print("Error parsing options: {}\n", ex.what());
+		return -1;
+	}
+
+	if (options.empty() || options.has("help") || !options.has("dst")) {
+		fmt::print("{} <options> dst\n", argv[0]);
+		fmt::print("{}\n", parser.format_help(argv[0]));
+		return 0;
+	}
+
+	auto generatorOptions = GeneratorOptions {};
+	auto get = [&](const char *name, auto &value) {
+		if (options.has(name)) {
+			value = options.get<std::decay_t<decltype(value)>>(name);
+		}
+	};
+
+	get("seed", generatorOptions.seed);
+	get("sections", generatorOptions.sections);
+	get("section-size", generatorOptions.sectionSize);
+	get("symbols", generatorOptions.symbols);
+	get("relocations", generatorOptions.relocations);
+	get("imports", generatorOptions.imports);
+	get("ghs-pairs", generatorOptions.ghsPairs);
+	get("entropy", generatorOptions.entropy);
+	get("level", generatorOptions.level);
+	generatorOptions.rpx = !options.has("rpl");
+
+	if (!generatorOptions.sections) {
+		fmt::print("At least one section is needed\n");
+		return -1;
+	}
+
+	auto generator = Generator { generatorOptions };
+	if (!generator.write(options.get<std::string>("dst"))) {
+		return -1;
+	}
+
+	return 0;
+}
@@ -1 +1,60 @@
-g++ *.cpp external/fmt/*.cpp -I include -I external/fmt/include -I external/excmd/include -o rpl2elf -lz
\ No newline at end of file
+#!/bin/sh
+CXXFLAGS="${CXXFLAGS:--O2}"
+INCLUDES="-I include -I external/fmt/include -I external/excmd/include"
+DEFINES=""
+LIBS="-lz"
+
+# Optional faster inflate engine, selectable with --inflate=libdeflate
+if echo '#include <libdeflate.h>' | g++ -E -x c++ - > /dev/null 2>&1; then
+	DEFINES="$DEFINES -DHAVE_LIBDEFLATE"
+	LIBS="$LIBS -ldeflate"
+fi
+
+# Optional zstd support for --compress-sections=zstd
+if echo '#include <zstd.h>' | g++ -E -x c++ - > /dev/null 2>&1; then
+	DEFINES="$DEFINES -DHAVE_ZSTD"
+	LIBS="$LIBS -lzstd"
+fi
+
+# librpl2elf.a holds everything but the command line tool, see converter.h
+# for the conversion API. Link it with $LIBS and -pthread.
+mkdir -p build
+OBJECTS=""
+for SOURCE in $(ls *.cpp | grep -v '^main\.cpp$') external/fmt/*.cpp; do
+	OBJECT="build/$(basename "$SOURCE" .cpp).o"
+	g++ $CXXFLAGS -c "$SOURCE" $INCLUDES $DEFINES -o "$OBJECT" || exit 1
+	OBJECTS="$OBJECTS $OBJECT"
+done
+
+rm -f librpl2elf.a
+ar rcs librpl2elf.a $OBJECTS || exit 1
+
+g++ $CXXFLAGS main.cpp $INCLUDES $DEFINES -o rpl2elf librpl2elf.a $LIBS -pthread || exit 1
+
+# ./build.sh bench also builds the synthetic .rpx generator and the stage
+# benchmark
+if [ "$1" = "bench" ]; then
+	g++ $CXXFLAGS bench/rplgen.cpp $INCLUDES -o bench/rplgen librpl2elf.a -lz || exit 1
+	g++ $CXXFLAGS bench/bench.cpp $INCLUDES $DEFINES -o bench/rpl2elf_bench librpl2elf.a $LIBS -pthread || exit 1
+fi
+
+# ./build.sh test builds each tests/*.cpp and runs it on an .rpx generated by
+# bench/rplgen
+if [ "$1" = "test" ]; then
+	g++ $CXXFLAGS bench/rplgen.cpp $INCLUDES -o bench/rplgen librpl2elf.a -lz || exit 1
+	WORKDIR=$(mktemp -d) || exit 1
+	# Sections larger than a 128 KiB compression block, so compress_test
+	# covers joining the blocks of one section, and more of them than
+	# budget_test's memory budget holds
+	bench/rplgen --seed=7 --sections=4 --section-size=327680 "$WORKDIR/input.rpx" > /dev/null || exit 1
+
+	RESULT=0
+	for SOURCE in tests/*.cpp; do
+		TEST="build/$(basename "$SOURCE" .cpp)"
+		g++ $CXXFLAGS "$SOURCE" $INCLUDES $DEFINES -o "$TEST" librpl2elf.a $LIBS -pthread || exit 1
+		"$TEST" "$WORKDIR/input.rpx" "$WORKDIR" || RESULT=1
+	done
+
+	rm -rf "$WORKDIR"
+	exit $RESULT
+fi
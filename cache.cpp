@@ -0,0 +1,314 @@
+#include "cache.h"
+#include "input_file.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fmt/format.h>
+#include <system_error>
+#include <vector>
+
+#ifdef PLATFORM_POSIX
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef PLATFORM_LINUX
+#include <linux/fs.h>
+#endif
+
+static const uint64_t Prime1 = 11400714785074694791ull;
+static const uint64_t Prime2 = 14029467366897019727ull;
+static const uint64_t Prime3 = 1609587929392839161ull;
+static const uint64_t Prime4 = 9650029242287828579ull;
+static const uint64_t Prime5 = 2870177450012600261ull;
+
+static inline uint64_t
+rotl64(uint64_t value, int shift)
+{
+   return (value << shift) | (value >> (64 - shift));
+}
+
+static inline uint64_t
+read64(const uint8_t *data)
+{
+   uint64_t value;
+   std::memcpy(&value, data, sizeof(value));
+   return value;
+}
+
+static inline uint32_t
+read32(const uint8_t *data)
+{
+   uint32_t value;
+   std::memcpy(&value, data, sizeof(value));
+   return value;
+}
+
+static inline uint64_t
+hashRound(uint64_t acc, uint64_t input)
+{
+   acc += input * Prime2;
+   acc = rotl64(acc, 31);
+   return acc * Prime1;
+}
+
+static inline uint64_t
+hashMerge(uint64_t acc, uint64_t value)
+{
+   acc ^= hashRound(0, value);
+   return acc * Prime1 + Prime4;
+}
+
+uint64_t
+hash64(const void *data,
+       size_t size,
+       uint64_t seed)
+{
+   auto ptr = reinterpret_cast<const uint8_t *>(data);
+   auto end = ptr + size;
+   auto hash = uint64_t { 0 };
+
+   if (size >= 32) {
+      auto v1 = seed + Prime1 + Prime2;
+      auto v2 = seed + Prime2;
+      auto v3 = seed;
+      auto v4 = seed - Prime1;
+
+      for (; end - ptr >= 32; ptr += 32) {
+         v1 = hashRound(v1, read64(ptr));
+         v2 = hashRound(v2, read64(ptr + 8));
+         v3 = hashRound(v3, read64(ptr + 16));
+         v4 = hashRound(v4, read64(ptr + 24));
+      }
+
+      hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+      hash = hashMerge(hash, v1);
+      hash = hashMerge(hash, v2);
+      hash = hashMerge(hash, v3);
+      hash = hashMerge(hash, v4);
+   } else {
+      hash = seed + Prime5;
+   }
+
+   hash += static_cast<uint64_t>(size);
+
+   for (; end - ptr >= 8; ptr += 8) {
+      hash ^= hashRound(0, read64(ptr));
+      hash = rotl64(hash, 27) * Prime1 + Prime4;
+   }
+
+   if (end - ptr >= 4) {
+      hash ^= static_cast<uint64_t>(read32(ptr)) * Prime1;
+      hash = rotl64(hash, 23) * Prime2 + Prime3;
+      ptr += 4;
+   }
+
+   for (; ptr < end; ++ptr) {
+      hash ^= *ptr * Prime5;
+      hash = rotl64(hash, 11) * Prime1;
+   }
+
+   hash ^= hash >> 33;
+   hash *= Prime2;
+   hash ^= hash >> 29;
+   hash *= Prime3;
+   hash ^= hash >> 32;
+   return hash;
+}
+
+std::string
+getCacheKey(const std::string &path,
+            const std::string &options)
+{
+   InputFile input;
+   if (!input.open(path, true)) {
+      return {};
+   }
+
+   auto contentHash = uint64_t { 0 };
+
+   if (input.mapped()) {
+      contentHash = hash64(input.view(0, input.size()), input.size());
+   } else {
+      std::vector<char> data(input.size());
+      if (!input.read(0, data.data(), data.size())) {
+         return {};
+      }
+
+      contentHash = hash64(data.data(), data.size());
+   }
+
+   return fmt::format("{:016x}{:08x}-{:016x}",
+                      contentHash,
+                      static_cast<uint32_t>(input.size()),
+                      hash64(options.data(), options.size()));
+}
+
+static std::string
+getEntryPath(const std::string &cacheDir,
+             const std::string &key)
+{
+   return (std::filesystem::path { cacheDir } / (key + ".elf")).string();
+}
+
+#ifdef PLATFORM_POSIX
+// Share the blocks of src with the open file dst, needs filesystem support
+static bool
+cloneFile(int src, int dst)
+{
+#ifdef FICLONE
+   return ioctl(dst, FICLONE, src) == 0;
+#else
+   return false;
+#endif
+}
+
+static bool
+copyFile(int src, int dst)
+{
+   char buffer[65536];
+
+   while (true) {
+      auto size = read(src, buffer, sizeof(buffer));
+
+      if (size < 0 && errno == EINTR) {
+         continue;
+      }
+
+      if (size <= 0) {
+         return size == 0;
+      }
+
+      for (auto written = ssize_t { 0 }; written < size; ) {
+         auto result = write(dst, buffer + written, static_cast<size_t>(size - written));
+
+         if (result < 0 && errno != EINTR) {
+            return false;
+         }
+
+         written += std::max<ssize_t>(result, 0);
+      }
+   }
+}
+#endif
+
+bool
+fetchCachedOutput(const std::string &cacheDir,
+                  const std::string &key,
+                  const std::string &dst)
+{
+   auto entry = getEntryPath(cacheDir, key);
+
+#ifdef PLATFORM_POSIX
+   auto src = open(entry.c_str(), O_RDONLY);
+   if (src < 0) {
+      return false;
+   }
+
+   // Replace dst rather than write through it, it may be a hardlink to
+   // another cache entry
+   unlink(dst.c_str());
+
+   auto fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   auto result = false;
+
+   if (fd >= 0 && cloneFile(src, fd)) {
+      result = true;
+   } else {
+      if (fd >= 0) {
+         close(fd);
+         unlink(dst.c_str());
+         fd = -1;
+      }
+
+      if (link(entry.c_str(), dst.c_str()) == 0) {
+         result = true;
+      } else {
+         fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         result = fd >= 0 && copyFile(src, fd);
+      }
+   }
+
+   if (fd >= 0 && close(fd) != 0) {
+      result = false;
+   }
+
+   close(src);
+
+   if (!result) {
+      unlink(dst.c_str());
+   }
+
+   return result;
+#else
+   auto error = std::error_code {};
+   return std::filesystem::copy_file(entry, dst, std::filesystem::copy_options::overwrite_existing, error);
+#endif
+}
+
+bool
+storeCachedOutput(const std::string &cacheDir,
+                  const std::string &key,
+                  const std::string &dst,
+                  std::string &error)
+{
+   auto errorCode = std::error_code {};
+   std::filesystem::create_directories(cacheDir, errorCode);
+
+   if (errorCode) {
+      error = errorCode.message();
+      return false;
+   }
+
+   auto entry = getEntryPath(cacheDir, key);
+
+#ifdef PLATFORM_POSIX
+   // Written under a unique name and renamed into place, so readers never
+   // see a partial entry
+   auto temp = entry + ".XXXXXX";
+   auto fd = mkstemp(&temp[0]);
+   if (fd < 0) {
+      error = std::strerror(errno);
+      return false;
+   }
+
+   // mkstemp creates 0600 files, entries are hardlinked to outputs so give
+   // them the mode a fresh conversion gets
+   fchmod(fd, 0644);
+
+   auto src = open(dst.c_str(), O_RDONLY);
+   auto result = src >= 0 && (cloneFile(src, fd) || copyFile(src, fd));
+
+   if (!result) {
+      error = std::strerror(errno);
+   }
+
+   if (src >= 0) {
+      close(src);
+   }
+
+   if (close(fd) != 0 && result) {
+      error = std::strerror(errno);
+      result = false;
+   }
+
+   if (result && rename(temp.c_str(), entry.c_str()) != 0) {
+      error = std::strerror(errno);
+      result = false;
+   }
+
+   if (!result) {
+      unlink(temp.c_str());
+   }
+
+   return result;
+#else
+   std::filesystem::copy_file(dst, entry, std::filesystem::copy_options::overwrite_existing, errorCode);
+   error = errorCode.message();
+   return !errorCode;
+#endif
+}
@@ -0,0 +1,367 @@
+#include "compressor.h"
+#include "parallel.h"
+#include <algorithm>
+#include <fmt/format.h>
+#include <memory>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Size of the blocks inputs are split into
+static const size_t DeflateBlockSize = 128 * 1024;
+
+// Size of the zstd frames inputs are split into, larger than the deflate
+// blocks as each frame starts without any history
+static const size_t ZstdFrameSize = 1024 * 1024;
+
+// Size of the deflate window, the dictionary given to every block
+static const size_t DeflateWindowSize = 32 * 1024;
+
+struct DeflateBlock
+{
+   size_t input;
+   size_t offset;
+   size_t size;
+   bool last;
+   uLong adler;
+   std::vector<char> output;
+};
+
+// Raw deflate of blocks, one per worker thread so the stream can be reset
+// instead of allocated for every block
+class BlockCompressor
+{
+public:
+   BlockCompressor(int level) :
+      mLevel(level)
+   {
+   }
+
+   ~BlockCompressor()
+   {
+      if (mInitialised) {
+         deflateEnd(&mStream);
+      }
+   }
+
+   bool
+   compress(const CompressorInput &input,
+            DeflateBlock &block,
+            std::string &error)
+   {
+      auto ret = mInitialised ? deflateReset(&mStream) : init();
+
+      if (ret != Z_OK) {
+         error = fmt::format("deflateInit returned {}", ret);
+         return false;
+      }
+
+      if (block.offset) {
+         auto dictionarySize = std::min(block.offset, DeflateWindowSize);
+         auto dictionary = input.data + block.offset - dictionarySize;
+         deflateSetDictionary(&mStream,
+                              reinterpret_cast<const Bytef *>(dictionary),
+                              static_cast<uInt>(dictionarySize));
+      }
+
+      auto data = input.data + block.offset;
+      block.adler = adler32(1, reinterpret_cast<const Bytef *>(data), static_cast<uInt>(block.size));
+      block.output.resize(deflateBound(&mStream, static_cast<uLong>(block.size)) + 16);
+
+      mStream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+      mStream.avail_in = static_cast<uInt>(block.size);
+      mStream.next_out = reinterpret_cast<Bytef *>(block.output.data());
+      mStream.avail_out = static_cast<uInt>(block.output.size());
+
+      // Every block but the last ends on a byte boundary, so the next one can
+      // be appended directly after it
+      auto flush = block.last ? Z_FINISH : Z_SYNC_FLUSH;
+
+      while (true) {
+         ret = deflate(&mStream, flush);
+
+         if (ret == Z_STREAM_ERROR) {
+            error = fmt::format("deflate returned {}", ret);
+            return false;
+         }
+
+         if (block.last ? ret == Z_STREAM_END : (!mStream.avail_in && mStream.avail_out)) {
+            break;
+         }
+
+         if (!mStream.avail_out) {
+            auto used = block.output.size();
+            block.output.resize(used * 2);
+            mStream.next_out = reinterpret_cast<Bytef *>(block.output.data() + used);
+            mStream.avail_out = static_cast<uInt>(block.output.size() - used);
+         }
+      }
+
+      block.output.resize(block.output.size() - mStream.avail_out);
+      return true;
+   }
+
+private:
+   int
+   init()
+   {
+      mStream = z_stream {};
+      mStream.zalloc = Z_NULL;
+      mStream.zfree = Z_NULL;
+      mStream.opaque = Z_NULL;
+
+      // Negative window bits for a raw deflate stream, compressBuffers adds
+      // the zlib header and trailer around the joined blocks
+      auto ret = deflateInit2(&mStream, mLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+      mInitialised = (ret == Z_OK);
+      return ret;
+   }
+
+private:
+   z_stream mStream;
+   bool mInitialised = false;
+   int mLevel;
+};
+
+// The two byte zlib stream header deflate writes for level
+static void
+writeZlibHeader(std::vector<char> &output,
+                int level)
+{
+   auto levelFlags = 0u;
+
+   if (level < 0 || level == 6) {
+      levelFlags = 2;
+   } else if (level < 2) {
+      levelFlags = 0;
+   } else if (level < 6) {
+      levelFlags = 1;
+   } else {
+      levelFlags = 3;
+   }
+
+   auto header = (0x78u << 8) | (levelFlags << 6);
+   header += 31 - (header % 31);
+   output.push_back(static_cast<char>(header >> 8));
+   output.push_back(static_cast<char>(header & 0xFF));
+}
+
+static bool
+deflateBuffers(const std::vector<CompressorInput> &inputs,
+               std::vector<std::vector<char>> &outputs,
+               int level,
+               unsigned jobs,
+               std::string &error)
+{
+   std::vector<DeflateBlock> blocks;
+
+   for (auto i = size_t { 0 }; i < inputs.size(); ++i) {
+      auto offset = size_t { 0 };
+
+      do {
+         auto size = std::min(inputs[i].size - offset, DeflateBlockSize);
+         blocks.push_back({ i, offset, size, offset + size == inputs[i].size, 0, {} });
+         offset += size;
+      } while (offset < inputs[i].size);
+   }
+
+   std::vector<std::unique_ptr<BlockCompressor>> compressors(std::max(1u, jobs));
+   std::vector<std::string> errors(blocks.size());
+   parallel_for(blocks.size(), jobs, [&](size_t i, unsigned worker) {
+      auto &compressor = compressors[worker];
+
+      if (!compressor) {
+         compressor.reset(new BlockCompressor { level });
+      }
+
+      compressor->compress(inputs[blocks[i].input], blocks[i], errors[i]);
+   });
+
+   for (auto &blockError : errors) {
+      if (!blockError.empty()) {
+         error = blockError;
+         return false;
+      }
+   }
+
+   // Join the blocks of every input behind one header, with the Adler-32 of
+   // the whole input as the trailer. The outputs are allocated at their
+   // final size so joining holds no more than the blocks left and the
+   // stream.
+   outputs.clear();
+   outputs.resize(inputs.size());
+
+   // Each stream has a 2 byte header and a 4 byte trailer around its blocks
+   std::vector<size_t> sizes(inputs.size(), 6);
+   for (auto &block : blocks) {
+      sizes[block.input] += block.output.size();
+   }
+
+   for (auto i = size_t { 0 }; i < inputs.size(); ++i) {
+      outputs[i].reserve(sizes[i]);
+   }
+
+   auto adler = adler32(0, Z_NULL, 0);
+   for (auto &block : blocks) {
+      auto &output = outputs[block.input];
+
+      if (block.offset == 0) {
+         writeZlibHeader(output, level);
+         adler = block.adler;
+      } else {
+         adler = adler32_combine(adler, block.adler, static_cast<z_off_t>(block.size));
+      }
+
+      output.insert(output.end(), block.output.begin(), block.output.end());
+      std::vector<char>().swap(block.output);
+
+      if (block.last) {
+         output.push_back(static_cast<char>(adler >> 24));
+         output.push_back(static_cast<char>(adler >> 16));
+         output.push_back(static_cast<char>(adler >> 8));
+         output.push_back(static_cast<char>(adler));
+      }
+   }
+
+   return true;
+}
+
+#ifdef HAVE_ZSTD
+struct ZstdFrame
+{
+   size_t input;
+   size_t offset;
+   size_t size;
+   std::vector<char> output;
+};
+
+static bool
+zstdBuffers(const std::vector<CompressorInput> &inputs,
+            std::vector<std::vector<char>> &outputs,
+            int level,
+            unsigned jobs,
+            std::string &error)
+{
+   std::vector<ZstdFrame> frames;
+
+   for (auto i = size_t { 0 }; i < inputs.size(); ++i) {
+      auto offset = size_t { 0 };
+
+      do {
+         auto size = std::min(inputs[i].size - offset, ZstdFrameSize);
+         frames.push_back({ i, offset, size, {} });
+         offset += size;
+      } while (offset < inputs[i].size);
+   }
+
+   // Contexts are kept per worker thread and reused for every frame
+   std::vector<ZSTD_CCtx *> contexts(std::max(1u, jobs), nullptr);
+   std::vector<std::string> errors(frames.size());
+   parallel_for(frames.size(), jobs, [&](size_t i, unsigned worker) {
+      auto &frame = frames[i];
+      auto &context = contexts[worker];
+
+      if (!context) {
+         context = ZSTD_createCCtx();
+      }
+
+      if (!context) {
+         errors[i] = "ZSTD_createCCtx failed";
+         return;
+      }
+
+      frame.output.resize(ZSTD_compressBound(frame.size));
+      auto result = ZSTD_compressCCtx(context,
+                                      frame.output.data(), frame.output.size(),
+                                      inputs[frame.input].data + frame.offset, frame.size,
+                                      level);
+
+      if (ZSTD_isError(result)) {
+         errors[i] = ZSTD_getErrorName(result);
+         return;
+      }
+
+      frame.output.resize(result);
+   });
+
+   for (auto context : contexts) {
+      ZSTD_freeCCtx(context);
+   }
+
+   for (auto &frameError : errors) {
+      if (!frameError.empty()) {
+         error = frameError;
+         return false;
+      }
+   }
+
+   outputs.clear();
+   outputs.resize(inputs.size());
+
+   std::vector<size_t> sizes(inputs.size(), 0);
+   for (auto &frame : frames) {
+      sizes[frame.input] += frame.output.size();
+   }
+
+   for (auto i = size_t { 0 }; i < inputs.size(); ++i) {
+      outputs[i].reserve(sizes[i]);
+   }
+
+   for (auto &frame : frames) {
+      auto &output = outputs[frame.input];
+      output.insert(output.end(), frame.output.begin(), frame.output.end());
+      std::vector<char>().swap(frame.output);
+   }
+
+   return true;
+}
+#endif
+
+bool
+compressBuffers(const std::vector<CompressorInput> &inputs,
+                std::vector<std::vector<char>> &outputs,
+                CompressorType type,
+                int level,
+                unsigned jobs,
+                std::string &error)
+{
+   switch (type) {
+   case CompressorType::Zlib:
+      return deflateBuffers(inputs, outputs, level, jobs, error);
+#ifdef HAVE_ZSTD
+   case CompressorType::Zstd:
+      return zstdBuffers(inputs, outputs, level, jobs, error);
+#endif
+   default:
+      error = "the compressor was not compiled in";
+      return false;
+   }
+}
+
+bool
+parseCompressorType(const std::string &name,
+                    CompressorType &type)
+{
+   if (name == "zlib") {
+      type = CompressorType::Zlib;
+   } else if (name == "zstd") {
+      type = CompressorType::Zstd;
+   } else {
+      return false;
+   }
+
+   return true;
+}
+
+std::vector<std::string>
+availableCompressors()
+{
+   return {
+      "zlib",
+#ifdef HAVE_ZSTD
+      "zstd",
+#endif
+   };
+}
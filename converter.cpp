@@ -0,0 +1,134 @@
+#include "converter.h"
+#include <chrono>
+#include <fmt/format.h>
+
+Converter::Converter(const ConverterOptions &options) :
+   mOptions(options)
+{
+   if (!createDecompressor(mOptions.decompressorType)) {
+      fmt::print("decompressor {} is not available in this build\n",
+                 getDecompressorName(mOptions.decompressorType));
+      mAvailable = false;
+   }
+}
+
+template<typename ReadFunction, typename WriteFunction>
+bool
+Converter::run(ReadFunction read,
+               WriteFunction write)
+{
+   if (!mAvailable) {
+      return false;
+   }
+
+   Rpl rpl;
+   rpl.importsAddress = mOptions.importsAddress;
+   rpl.programHeaders = mOptions.programHeaders;
+   rpl.strip = mOptions.strip;
+   rpl.compressSections = mOptions.compressSections;
+   rpl.compressAllSections = mOptions.compressAllSections;
+   rpl.sectionCompressor = mOptions.sectionCompressor;
+   rpl.sectionCompressionLevel = mOptions.sectionCompressionLevel;
+   rpl.memoryBudget = mOptions.memoryBudget;
+
+   auto runStage = [&](const char *name, auto &&stage) {
+      auto start = std::chrono::steady_clock::now();
+
+      if (!stage(rpl)) {
+         fmt::print("ERROR: {} failed.\n", name);
+         return false;
+      }
+
+      if (mOptions.stageStats) {
+         auto time = std::chrono::duration<double, std::milli> { std::chrono::steady_clock::now() - start };
+         rpl.stats.stages.push_back({ name, time.count(), getPeakRss() });
+      }
+
+      return true;
+   };
+
+   auto result =
+      runStage("readRpl", read) &&
+      (!mOptions.verify || runStage("verifyCrcs", [&](Rpl &rpl) { return verifyCrcs(rpl, mOptions.jobs); })) &&
+      runStage("decodeTables", decodeTables) &&
+      runStage("fixFileHeader", fixFileHeader) &&
+      runStage("fixRelocations", fixRelocations) &&
+      runStage("relocateImports", relocateImports) &&
+      (!mOptions.strip || runStage("stripSections", stripSections)) &&
+      runStage("encodeTables", encodeTables) &&
+      (!mOptions.compressSections ||
+       runStage("compressOutputSections", [&](Rpl &rpl) { return compressOutputSections(rpl, mOptions.jobs); })) &&
+      runStage("calculateSectionOffsets", calculateSectionOffsets) &&
+      runStage("writeElf", write);
+
+   mStats = std::move(rpl.stats);
+   return result;
+}
+
+bool
+Converter::convert(const std::string &src,
+                   const std::string &dst)
+{
+   return run(
+      [&](Rpl &rpl) {
+         return readRpl(rpl, src, mOptions.map, mOptions.decompressorType, mOptions.jobs);
+      },
+      [&](Rpl &rpl) {
+         return writeElf(rpl, dst);
+      });
+}
+
+bool
+Converter::convert(const std::string &src,
+                   std::FILE *dst)
+{
+   return run(
+      [&](Rpl &rpl) {
+         return readRpl(rpl, src, mOptions.map, mOptions.decompressorType, mOptions.jobs);
+      },
+      [&](Rpl &rpl) {
+         return writeElf(rpl, dst);
+      });
+}
+
+bool
+Converter::convert(const void *data,
+                   size_t size,
+                   std::vector<char> &output)
+{
+   return run(
+      [&](Rpl &rpl) {
+         return readRpl(rpl, data, size, mOptions.decompressorType, mOptions.jobs);
+      },
+      [&](Rpl &rpl) {
+         return writeElf(rpl, output);
+      });
+}
+
+bool
+Converter::convert(const void *data,
+                   size_t size,
+                   const std::string &dst)
+{
+   return run(
+      [&](Rpl &rpl) {
+         return readRpl(rpl, data, size, mOptions.decompressorType, mOptions.jobs);
+      },
+      [&](Rpl &rpl) {
+         return writeElf(rpl, dst);
+      });
+}
+
+bool
+Converter::convert(const void *data,
+                   size_t size,
+                   std::FILE *dst)
+{
+   return run(
+      [&](Rpl &rpl) {
+         return readRpl(rpl, data, size, mOptions.decompressorType, mOptions.jobs);
+      },
+      [&](Rpl &rpl) {
+         return writeElf(rpl, dst);
+      });
+}
@@ -0,0 +1,29 @@
+#include "crc.h"
+#include <algorithm>
+#include <zlib.h>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+uint32_t
+updateCrc32(uint32_t crc,
+            const void *data,
+            size_t size)
+{
+#ifdef HAVE_LIBDEFLATE
+   return libdeflate_crc32(crc, data, size);
+#else
+   auto bytes = reinterpret_cast<const Bytef *>(data);
+
+   // zlib takes the length as a uInt
+   while (size) {
+      auto length = static_cast<uInt>(std::min<size_t>(size, 0x40000000));
+      crc = static_cast<uint32_t>(crc32(crc, bytes, length));
+      bytes += length;
+      size -= length;
+   }
+
+   return crc;
+#endif
+}
@@ -0,0 +1,321 @@
+#include "decompressor.h"
+#include <algorithm>
+#include <fmt/format.h>
+#include <zlib.h>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+// Size of the compressed blocks fed to inflate
+static const size_t InflateBlockSize = 64 * 1024;
+
+// Size of the pieces decompressStream hands out at a time
+static const size_t InflateWindowSize = 256 * 1024;
+
+// zlib inflate, fed in fixed size blocks read from the file into a small
+// buffer or taken straight from the mapping.
+class ZlibDecompressor : public Decompressor
+{
+public:
+   ~ZlibDecompressor() override
+   {
+      if (mInitialised) {
+         inflateEnd(&mStream);
+      }
+   }
+
+   bool
+   decompress(InputFile &input,
+              size_t offset,
+              size_t size,
+              char *dst,
+              size_t dstSize,
+              std::string &error) override
+   {
+      return run(input, offset, size, dstSize, dst, dstSize, nullptr, error);
+   }
+
+   bool
+   decompressStream(InputFile &input,
+                    size_t offset,
+                    size_t size,
+                    size_t dstSize,
+                    const Sink &sink,
+                    std::string &error) override
+   {
+      mWindow.resize(std::max<size_t>(1, std::min(dstSize, InflateWindowSize)));
+      return run(input, offset, size, dstSize, mWindow.data(), mWindow.size(), &sink, error);
+   }
+
+private:
+   // Inflate into window, which is handed to sink every time it fills up
+   // when there is one, otherwise it must hold all dstSize bytes
+   bool
+   run(InputFile &input,
+       size_t offset,
+       size_t size,
+       size_t dstSize,
+       char *window,
+       size_t windowSize,
+       const Sink *sink,
+       std::string &error)
+   {
+      auto ret = mInitialised ? inflateReset(&mStream) : init();
+
+      if (ret != Z_OK) {
+         error = fmt::format("inflateInit returned {}", ret);
+         return false;
+      }
+
+      if (!input.mapped()) {
+         mBlock.resize(std::min(size, InflateBlockSize));
+      }
+
+      mStream.avail_in = 0;
+      mStream.avail_out = static_cast<uInt>(windowSize);
+      mStream.next_out = reinterpret_cast<Bytef *>(window);
+
+      while (ret != Z_STREAM_END) {
+         if (sink && !mStream.avail_out) {
+            if (mStream.total_out > dstSize) {
+               error = fmt::format("the inflated data is larger than expected {} bytes", dstSize);
+               return false;
+            }
+
+            if (!(*sink)(window, windowSize)) {
+               error = "the inflated data could not be written";
+               return false;
+            }
+
+            mStream.avail_out = static_cast<uInt>(windowSize);
+            mStream.next_out = reinterpret_cast<Bytef *>(window);
+         }
+
+         if (!mStream.avail_in && size) {
+            auto blockSize = std::min(size, InflateBlockSize);
+            auto compressed = input.view(offset, blockSize);
+
+            if (!compressed) {
+               if (!input.read(offset, mBlock.data(), blockSize)) {
+                  break;
+               }
+
+               compressed = mBlock.data();
+            }
+
+            mStream.avail_in = static_cast<uInt>(blockSize);
+            mStream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(compressed));
+            offset += blockSize;
+            size -= blockSize;
+         }
+
+         ret = inflate(&mStream, Z_NO_FLUSH);
+
+         if (ret != Z_OK && ret != Z_STREAM_END) {
+            break;
+         }
+      }
+
+      if (ret == Z_OK || (ret == Z_BUF_ERROR && !mStream.avail_in && mStream.avail_out)) {
+         error = "the compressed data is truncated";
+         return false;
+      } else if (ret == Z_BUF_ERROR) {
+         error = fmt::format("the inflated data is larger than expected {} bytes", dstSize);
+         return false;
+      } else if (ret != Z_STREAM_END) {
+         error = fmt::format("inflate returned {}", ret);
+         return false;
+      }
+
+      if (mStream.total_out != dstSize) {
+         error = fmt::format("the inflated data is {} bytes but expected {}", mStream.total_out, dstSize);
+         return false;
+      }
+
+      if (sink && mStream.avail_out != windowSize &&
+          !(*sink)(window, windowSize - mStream.avail_out)) {
+         error = "the inflated data could not be written";
+         return false;
+      }
+
+      return true;
+   }
+
+   int
+   init()
+   {
+      mStream = z_stream {};
+      mStream.zalloc = Z_NULL;
+      mStream.zfree = Z_NULL;
+      mStream.opaque = Z_NULL;
+
+      auto ret = inflateInit(&mStream);
+      mInitialised = (ret == Z_OK);
+      return ret;
+   }
+
+private:
+   z_stream mStream;
+   bool mInitialised = false;
+   std::vector<char> mBlock;
+   std::vector<char> mWindow;
+};
+
+#ifdef HAVE_LIBDEFLATE
+// libdeflate works on whole buffers, the compressed body is used in place
+// from the mapping or read into a buffer reused between sections.
+class LibdeflateDecompressor : public Decompressor
+{
+public:
+   LibdeflateDecompressor() :
+      mDecompressor(libdeflate_alloc_decompressor())
+   {
+   }
+
+   ~LibdeflateDecompressor() override
+   {
+      if (mDecompressor) {
+         libdeflate_free_decompressor(mDecompressor);
+      }
+   }
+
+   bool
+   decompress(InputFile &input,
+              size_t offset,
+              size_t size,
+              char *dst,
+              size_t dstSize,
+              std::string &error) override
+   {
+      if (!mDecompressor) {
+         error = "libdeflate_alloc_decompressor failed";
+         return false;
+      }
+
+      auto compressed = input.view(offset, size);
+
+      if (!compressed) {
+         mBuffer.resize(size);
+
+         if (!input.read(offset, mBuffer.data(), size)) {
+            error = "the compressed data is truncated";
+            return false;
+         }
+
+         compressed = mBuffer.data();
+      }
+
+      auto actualSize = size_t { 0 };
+      auto ret = libdeflate_zlib_decompress(mDecompressor, compressed, size, dst, dstSize, &actualSize);
+
+      switch (ret) {
+      case LIBDEFLATE_SUCCESS:
+         break;
+      case LIBDEFLATE_BAD_DATA:
+         error = "the compressed data is corrupt or truncated";
+         return false;
+      case LIBDEFLATE_INSUFFICIENT_SPACE:
+         error = fmt::format("the inflated data is larger than expected {} bytes", dstSize);
+         return false;
+      default:
+         error = fmt::format("libdeflate_zlib_decompress returned {}", static_cast<int>(ret));
+         return false;
+      }
+
+      if (actualSize != dstSize) {
+         error = fmt::format("the inflated data is {} bytes but expected {}", actualSize, dstSize);
+         return false;
+      }
+
+      return true;
+   }
+
+private:
+   libdeflate_decompressor *mDecompressor;
+   std::vector<char> mBuffer;
+};
+#endif
+
+bool
+Decompressor::decompressStream(InputFile &input,
+                               size_t offset,
+                               size_t size,
+                               size_t dstSize,
+                               const Sink &sink,
+                               std::string &error)
+{
+   std::vector<char> data(dstSize);
+
+   if (!decompress(input, offset, size, data.data(), data.size(), error)) {
+      return false;
+   }
+
+   if (!sink(data.data(), data.size())) {
+      error = "the inflated data could not be written";
+      return false;
+   }
+
+   return true;
+}
+
+std::unique_ptr<Decompressor>
+createDecompressor(DecompressorType type)
+{
+   switch (type) {
+   case DecompressorType::Zlib:
+      return std::unique_ptr<Decompressor> { new ZlibDecompressor {} };
+#ifdef HAVE_LIBDEFLATE
+   case DecompressorType::Libdeflate:
+      return std::unique_ptr<Decompressor> { new LibdeflateDecompressor {} };
+#endif
+   default:
+      return nullptr;
+   }
+}
+
+bool
+isStreamingDecompressor(DecompressorType type)
+{
+   // libdeflate has no streaming API, it uses the whole-buffer fallback
+   return type == DecompressorType::Zlib;
+}
+
+const char *
+getDecompressorName(DecompressorType type)
+{
+   switch (type) {
+   case DecompressorType::Zlib:
+      return "zlib";
+   case DecompressorType::Libdeflate:
+      return "libdeflate";
+   default:
+      return "unknown";
+   }
+}
+
+bool
+parseDecompressorType(const std::string &name,
+                      DecompressorType &type)
+{
+   if (name == "zlib") {
+      type = DecompressorType::Zlib;
+   } else if (name == "libdeflate") {
+      type = DecompressorType::Libdeflate;
+   } else {
+      return false;
+   }
+
+   return true;
+}
+
+std::vector<std::string>
+availableDecompressors()
+{
+   return {
+      "zlib",
+#ifdef HAVE_LIBDEFLATE
+      "libdeflate",
+#endif
+   };
+}
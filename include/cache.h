@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Content addressed cache of converted files for --cache-dir.
+//
+// Entries are named after a hash of the input file contents, the converter
+// version and the options which change the output, so a hit can be served
+// without reading the input any further than hashing it.
+
+// 64-bit xxHash of data
+uint64_t
+hash64(const void *data,
+       size_t size,
+       uint64_t seed = 0);
+
+// Cache key for converting path, empty if the file could not be read
+std::string
+getCacheKey(const std::string &path,
+            const std::string &options);
+
+// Produce dst from the cache entry for key, preferring a reflink, then a
+// hardlink and then a plain copy. Returns false on a cache miss.
+bool
+fetchCachedOutput(const std::string &cacheDir,
+                  const std::string &key,
+                  const std::string &dst);
+
+// Add dst to the cache as the entry for key, entries appear atomically so
+// several processes can share a cache directory
+bool
+storeCachedOutput(const std::string &cacheDir,
+                  const std::string &key,
+                  const std::string &dst,
+                  std::string &error);
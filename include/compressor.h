@@ -0,0 +1,44 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Formats compressBuffers can produce
+enum class CompressorType
+{
+   Zlib,
+   Zstd,
+};
+
+// Data to be compressed into one stream
+struct CompressorInput
+{
+   const char *data;
+   size_t size;
+};
+
+// Compress every input into a stream of the given type in outputs, using up
+// to jobs threads with the given level of that compressor.
+//
+// Inputs are split into blocks which are compressed independently, so a
+// single large input still uses every thread. For zlib each block is primed
+// with the data before it as a dictionary and ended with a sync flush, then
+// the blocks are joined into a single stream the way pigz does. For zstd
+// each block is a frame of its own, decoders take concatenated frames as
+// one stream.
+bool
+compressBuffers(const std::vector<CompressorInput> &inputs,
+                std::vector<std::vector<char>> &outputs,
+                CompressorType type,
+                int level,
+                unsigned jobs,
+                std::string &error);
+
+// Parses a compressor name as given on the command line
+bool
+parseCompressorType(const std::string &name,
+                    CompressorType &type);
+
+// Names of the compressors which are compiled in
+std::vector<std::string>
+availableCompressors();
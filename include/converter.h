@@ -0,0 +1,101 @@
+#pragma once
+#include "compressor.h"
+#include "decompressor.h"
+#include "rpl2elf.h"
+#include "stats.h"
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct ConverterOptions
+{
+   DecompressorType decompressorType = DecompressorType::Zlib;
+
+   // Threads used to inflate the sections of one file
+   unsigned jobs = 1;
+
+   // Map input files into memory instead of reading them
+   bool map = false;
+
+   // Address the import sections are relocated to
+   uint32_t importsAddress = DefaultImportsAddress;
+
+   // Add PT_LOAD program headers, see calculateSectionOffsets
+   bool programHeaders = false;
+
+   // StripPolicy mask of sections to remove, see stripSections
+   uint32_t strip = 0;
+
+   // Write SHF_COMPRESSED sections, see compressOutputSections
+   bool compressSections = false;
+   bool compressAllSections = false;
+   CompressorType sectionCompressor = CompressorType::Zlib;
+   int sectionCompressionLevel = 6;
+
+   // Bytes of section contents one conversion may hold in memory, 0 for no
+   // limit, see Rpl::memoryBudget
+   size_t memoryBudget = 0;
+
+   // Check section contents against SHT_RPL_CRCS before converting
+   bool verify = false;
+
+   // Time every stage into stats().stages
+   bool stageStats = false;
+};
+
+// Converts an .rpl / .rpx to an .elf, between files or buffers in memory.
+//
+// Each conversion keeps its state in the call, nothing is shared between
+// converters, so threads can convert in parallel with a converter each.
+// Errors are printed the same way as by the command line tool.
+class Converter
+{
+public:
+   // Options naming an engine which was not compiled in are reported here,
+   // every convert then fails
+   Converter(const ConverterOptions &options = {});
+
+   bool
+   convert(const std::string &src,
+           const std::string &dst);
+
+   // Write the output to a stream which cannot seek, such as stdout
+   bool
+   convert(const std::string &src,
+           std::FILE *dst);
+
+   // Convert size bytes at data into output, which is resized to fit
+   bool
+   convert(const void *data,
+           size_t size,
+           std::vector<char> &output);
+
+   bool
+   convert(const void *data,
+           size_t size,
+           const std::string &dst);
+
+   bool
+   convert(const void *data,
+           size_t size,
+           std::FILE *dst);
+
+   // Counters of the last conversion
+   const ConvertStats &
+   stats() const
+   {
+      return mStats;
+   }
+
+private:
+   template<typename ReadFunction, typename WriteFunction>
+   bool
+   run(ReadFunction read,
+       WriteFunction write);
+
+private:
+   ConverterOptions mOptions;
+   bool mAvailable = true;
+   ConvertStats mStats;
+};
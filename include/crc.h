@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Continue the CRC-32 crc, start from 0, with size bytes at data.
+//
+// Uses libdeflate's CRC-32, which is hardware accelerated where the CPU
+// allows, when it is compiled in and zlib's otherwise.
+uint32_t
+updateCrc32(uint32_t crc,
+            const void *data,
+            size_t size);
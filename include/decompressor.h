@@ -0,0 +1,69 @@
+#pragma once
+#include "input_file.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Engines available to inflate SHF_DEFLATED section bodies
+enum class DecompressorType
+{
+   Zlib,
+   Libdeflate,
+};
+
+// Inflates the zlib streams of SHF_DEFLATED sections.
+//
+// A decompressor keeps its context between calls so one instance can be
+// reused for every section a worker thread inflates. Instances must not be
+// shared between threads.
+class Decompressor
+{
+public:
+   virtual ~Decompressor() = default;
+
+   // Inflate the size bytes at offset in input into exactly dstSize bytes
+   // at dst. On failure error describes what went wrong.
+   virtual bool
+   decompress(InputFile &input,
+              size_t offset,
+              size_t size,
+              char *dst,
+              size_t dstSize,
+              std::string &error) = 0;
+
+   using Sink = std::function<bool(const char *data, size_t size)>;
+
+   // Inflate into dstSize bytes which are passed to sink in order, a piece
+   // at a time where the engine supports it so the whole body never has to
+   // be held in memory.
+   virtual bool
+   decompressStream(InputFile &input,
+                    size_t offset,
+                    size_t size,
+                    size_t dstSize,
+                    const Sink &sink,
+                    std::string &error);
+};
+
+// Returns nullptr when the engine was not compiled in
+std::unique_ptr<Decompressor>
+createDecompressor(DecompressorType type);
+
+// Returns false for engines whose decompressStream inflates the whole body
+// into one buffer before passing it on, a memory budget has to allow for it
+bool
+isStreamingDecompressor(DecompressorType type);
+
+// Name of an engine as given on the command line
+const char *
+getDecompressorName(DecompressorType type);
+
+// Parses an engine name as given on the command line
+bool
+parseDecompressorType(const std::string &name,
+                      DecompressorType &type);
+
+// Names of the engines which are compiled in
+std::vector<std::string>
+availableDecompressors();
@@ -56,6 +56,7 @@ enum SectionFlags : uint32_t // sh_flags
    SHF_WRITE = 0x1,
    SHF_ALLOC = 0x2,
    SHF_EXECINSTR = 0x4,
+   SHF_COMPRESSED = 0x800,
    SHF_DEFLATED = 0x08000000,
    SHF_MASKPROC = 0xF0000000,
 };
@@ -89,6 +90,30 @@ enum SectionType : uint32_t // sh_type
    SHT_HIUSER = 0xffffffff       // Highest type reserved for applications.
 };
 
+enum CompressionType : uint32_t // ch_type
+{
+   ELFCOMPRESS_ZLIB = 1,         // zlib stream
+   ELFCOMPRESS_ZSTD = 2,         // zstd frames
+};
+
+enum SegmentType : uint32_t // p_type
+{
+   PT_NULL = 0,                  // Unused entry.
+   PT_LOAD = 1,                  // Loadable segment.
+   PT_DYNAMIC = 2,               // Dynamic linking information.
+   PT_INTERP = 3,                // Interpreter pathname.
+   PT_NOTE = 4,                  // Auxiliary information.
+   PT_SHLIB = 5,                 // Reserved.
+   PT_PHDR = 6,                  // The program header table itself.
+};
+
+enum SegmentFlags : uint32_t // p_flags
+{
+   PF_X = 0x1,                   // Execute
+   PF_W = 0x2,                   // Write
+   PF_R = 0x4,                   // Read
+};
+
 enum SymbolBinding : uint32_t // st_info > 4
 {
    STB_LOCAL = 0,       // Local symbol, not visible outside obj file containing def
@@ -242,6 +267,28 @@ struct SectionHeader
 };
 CHECK_SIZE(SectionHeader, 0x28);
 
+struct ProgramHeader
+{
+   be_val<uint32_t> type;      // Segment type (PT_*)
+   be_val<uint32_t> offset;    // File offset of the segment, in bytes
+   be_val<uint32_t> vaddr;     // Address where the segment is to be loaded
+   be_val<uint32_t> paddr;     // Physical address, same as vaddr
+   be_val<uint32_t> filesz;    // Size of the segment in the file, in bytes
+   be_val<uint32_t> memsz;     // Size of the segment in memory, in bytes
+   be_val<uint32_t> flags;     // Segment flags (PF_*)
+   be_val<uint32_t> align;     // Alignment of offset and vaddr
+};
+CHECK_SIZE(ProgramHeader, 0x20);
+
+// Starts the contents of a SHF_COMPRESSED section
+struct CompressionHeader
+{
+   be_val<uint32_t> type;      // Compression format (ELFCOMPRESS_*)
+   be_val<uint32_t> size;      // Uncompressed size, in bytes
+   be_val<uint32_t> addralign; // Uncompressed address alignment
+};
+CHECK_SIZE(CompressionHeader, 0x0C);
+
 struct Symbol
 {
    be_val<uint32_t> name;  // Symbol name (index into string table)
@@ -261,6 +308,31 @@ struct Rela
 };
 CHECK_SIZE(Rela, 0x0C);
 
+// Native endian layouts of Symbol and Rela, as produced by swapping every
+// 32-bit word of the big endian structure with byte_swap_words on a little
+// endian host. This lets whole tables be converted in a single call.
+struct NativeSymbol
+{
+   uint32_t name;
+   uint32_t value;
+   uint32_t size;
+   uint16_t shndx;
+   uint8_t other;
+   uint8_t info;
+};
+CHECK_SIZE(NativeSymbol, 0x10);
+
+struct NativeRela
+{
+   uint32_t offset;
+   uint32_t info;
+   int32_t addend;
+};
+CHECK_SIZE(NativeRela, 0x0C);
+
+static const size_t SymbolWords = sizeof(Symbol) / sizeof(uint32_t);
+static const size_t RelaWords = sizeof(Rela) / sizeof(uint32_t);
+
 struct RplImport
 {
    be_val<uint32_t> count;
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstddef>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+// Random access reader for the input .rpl file.
+//
+// The file is either read through a stream, or mapped into memory once in
+// which case ranges of it can be accessed in place with view(). A buffer
+// already in memory can be used the same way as a mapping.
+class InputFile
+{
+public:
+   InputFile() = default;
+   InputFile(const InputFile &) = delete;
+   InputFile &operator =(const InputFile &) = delete;
+   ~InputFile();
+
+   bool open(const std::string &path, bool map);
+   void close();
+
+   // Use size bytes at data as the file, they are accessed in place like a
+   // mapping and must stay valid until the file is closed
+   void openMemory(const void *data, size_t size);
+
+   // Copy size bytes at offset into dst, fails if the range is out of bounds.
+   // Safe to call from several threads at once.
+   bool read(size_t offset, void *dst, size_t size);
+
+   // Pointer to size bytes at offset, nullptr if not mapped or out of bounds
+   const char *view(size_t offset, size_t size) const;
+
+   bool contains(size_t offset, size_t size) const
+   {
+      return offset <= mSize && size <= mSize - offset;
+   }
+
+   bool mapped() const
+   {
+      return mMapping != nullptr;
+   }
+
+   size_t size() const
+   {
+      return mSize;
+   }
+
+private:
+   std::ifstream mStream;
+   std::mutex mStreamMutex;
+   const char *mMapping = nullptr;
+   bool mOwnsMapping = false;
+   size_t mSize = 0;
+};
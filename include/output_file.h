@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+// A piece of the output file, data must stay valid until it is written
+struct OutputChunk
+{
+   using Writer = std::function<bool(const char *data, size_t size)>;
+
+   size_t offset;
+   const char *data;
+   size_t size;
+
+   // Set instead of data for contents generated while the file is written,
+   // produce passes exactly size bytes to write in order
+   std::function<bool(const Writer &write, std::string &error)> produce = nullptr;
+};
+
+// Writes the chunks to path in file order, zero filling the gaps between
+// them. Chunks may be given in any order but must not overlap.
+//
+// The file is written under a temporary name and renamed over path, so
+// path may name the file the chunks are still being read from.
+//
+// On POSIX the chunks in memory are emitted with gather writes (pwritev), so
+// the number of syscalls does not grow with the number of sections.
+// Generated chunks are streamed to their offset as they are produced. A non-zero
+// fileSize is used to allocate the file's blocks before writing.
+bool
+writeOutputFile(const std::string &path,
+                std::vector<OutputChunk> chunks,
+                size_t fileSize,
+                std::string &error);
+
+// Same as writeOutputFile but into memory, output is resized to the end of
+// the last chunk or fileSize, whichever is larger.
+bool
+writeOutputBuffer(std::vector<OutputChunk> chunks,
+                  size_t fileSize,
+                  std::vector<char> &output,
+                  std::string &error);
+
+// Same as writeOutputFile but to a stream which cannot seek, such as a pipe.
+// Everything is written once in increasing offset order, gaps and the space
+// up to fileSize are written as zeros.
+bool
+writeOutputStream(std::FILE *stream,
+                  std::vector<OutputChunk> chunks,
+                  size_t fileSize,
+                  std::string &error);
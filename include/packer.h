@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+
+struct PackOptions
+{
+   // zlib level SHF_DEFLATED sections are compressed with
+   int level = 6;
+
+   // Threads used to compress the sections of one file
+   unsigned jobs = 1;
+
+   // Map the input file into memory instead of reading it
+   bool map = false;
+};
+
+// Packs an .elf back into an .rpx: the sections are compressed with their
+// 4 byte size prefix, the CRCs section and the region sizes in the fileinfo
+// are recomputed and the file header is restored. The .elf needs the CRCs
+// and fileinfo sections, as kept by the conversion to .elf. Relocations and
+// imports are packed as they are, the changes made by fixRelocations and
+// relocateImports are not undone.
+bool
+packRpl(const std::string &src,
+        const std::string &dst,
+        const PackOptions &options);
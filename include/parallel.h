@@ -0,0 +1,53 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Number of worker threads to use when the user did not ask for a count
+inline unsigned
+default_job_count()
+{
+   return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls fn(i, worker) for every i in [0, count) using up to jobs threads, the
+// calling thread takes part in the work. Items are handed out in order.
+// worker is in [0, jobs) and identifies the thread, so per thread state can
+// be kept in a vector indexed by it.
+template<typename Function>
+inline void
+parallel_for(size_t count, unsigned jobs, Function fn)
+{
+   auto threadCount = static_cast<size_t>(std::max(1u, jobs));
+   threadCount = std::min(threadCount, count);
+
+   if (threadCount <= 1) {
+      for (auto i = size_t { 0 }; i < count; ++i) {
+         fn(i, 0u);
+      }
+
+      return;
+   }
+
+   std::atomic<size_t> next { 0 };
+   auto worker = [&](unsigned id) {
+      for (auto i = next++; i < count; i = next++) {
+         fn(i, id);
+      }
+   };
+
+   std::vector<std::thread> threads;
+   threads.reserve(threadCount - 1);
+
+   for (auto i = 1u; i < threadCount; ++i) {
+      threads.emplace_back(worker, i);
+   }
+
+   worker(0u);
+
+   for (auto &thread : threads) {
+      thread.join();
+   }
+}
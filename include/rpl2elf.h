@@ -1,13 +1,191 @@
 #pragma once
+#include "compressor.h"
+#include "decompressor.h"
 #include "elf.h"
+#include "input_file.h"
+#include "stats.h"
+#include <cstdio>
 #include <string>
 #include <vector>
 
+// Native endian SHT_RELA table, one array per field
+struct RelocationTable
+{
+   size_t count() const
+   {
+      return offset.size();
+   }
+
+   void resize(size_t count)
+   {
+      offset.resize(count);
+      symbol.resize(count);
+      type.resize(count);
+      addend.resize(count);
+   }
+
+   std::vector<uint32_t> offset;
+   std::vector<uint32_t> symbol;
+   std::vector<uint8_t> type;
+   std::vector<int32_t> addend;
+};
+
+// Native endian SHT_SYMTAB table, one array per field
+struct SymbolTable
+{
+   size_t count() const
+   {
+      return value.size();
+   }
+
+   void resize(size_t count)
+   {
+      name.resize(count);
+      value.resize(count);
+      size.resize(count);
+      info.resize(count);
+      other.resize(count);
+      shndx.resize(count);
+   }
+
+   std::vector<uint32_t> name;
+   std::vector<uint32_t> value;
+   std::vector<uint32_t> size;
+   std::vector<uint8_t> info;
+   std::vector<uint8_t> other;
+   std::vector<uint16_t> shndx;
+};
+
 struct Section
 {
+   // Section contents, either a view into the mapped input or owned data
+   const char *bytes() const
+   {
+      return view ? view : data.data();
+   }
+
+   size_t size() const
+   {
+      if (compressed) {
+         return inflatedSize;
+      }
+
+      if (deferred) {
+         return deferredSize;
+      }
+
+      return view ? viewSize : data.size();
+   }
+
+   // Owned section contents, copied out of the mapped input on first use.
+   // Compressed and deferred sections must be loaded with loadSection first.
+   std::vector<char> &mutableData()
+   {
+      if (view) {
+         data.assign(view, view + viewSize);
+         view = nullptr;
+         viewSize = 0;
+      }
+
+      return data;
+   }
+
+   void clearData()
+   {
+      compressed = false;
+      deferred = false;
+      inflatedSize = 0;
+      view = nullptr;
+      viewSize = 0;
+      data.clear();
+   }
+
    elf::SectionHeader header;
    std::string name;
    std::vector<char> data;
+   const char *view = nullptr;
+   size_t viewSize = 0;
+
+   // SHF_DEFLATED contents readRpl left compressed in the input, they are
+   // inflated by loadSection or streamed to the output by writeElf
+   bool compressed = false;
+   size_t compressedOffset = 0;
+   size_t compressedSize = 0;
+   size_t inflatedSize = 0;
+
+   // Uncompressed contents readRpl left in the input under a memory budget,
+   // read by loadSection or copied to the output by writeElf
+   bool deferred = false;
+   size_t deferredOffset = 0;
+   size_t deferredSize = 0;
+
+   // Decoded SHT_RELA and SHT_SYMTAB contents, these replace data between
+   // decodeTables and encodeTables
+   RelocationTable relocations;
+   SymbolTable symbols;
+};
+
+// Changed whenever the output for a given input and options changes, it is
+// part of the --cache-dir key
+static const char ConverterVersion[] = "rpl2elf 3";
+
+// File offsets of PT_LOAD segments are congruent to their address modulo
+// this, so a consumer can map them page by page
+static const uint32_t SegmentAlignment = 0x1000;
+
+// Default address the import sections are relocated to, in loader memory
+static const uint32_t DefaultImportsAddress = 0x01000000;
+
+// Sections removed by stripSections, combined as a mask
+enum StripPolicy : uint32_t
+{
+   // Non-alloc .debug* and .line sections and their relocations
+   StripDebug = 1 << 0,
+
+   // SHT_RPL_CRCS and SHT_RPL_FILEINFO
+   StripRplMetadata = 1 << 1,
+
+   // SHT_NULL entries besides the first and sections without contents
+   // which nothing refers to
+   StripEmpty = 1 << 2,
+};
+
+// Where a section is placed in the output file, in file order
+enum class LayoutCategory : uint8_t
+{
+   Crcs,
+   FileInfo,
+   Data,
+   Read,
+   Imports,
+   Text,
+   Temp,
+   None,
+};
+
+struct LayoutEntry
+{
+   uint32_t index;
+   uint32_t offset;
+   uint32_t size;
+   LayoutCategory category;
+};
+
+// Output file layout planned by calculateSectionOffsets
+struct Layout
+{
+   uint32_t sectionHeadersOffset = 0;
+   uint32_t sectionHeadersSize = 0;
+
+   // Sections with file contents, sorted by offset
+   std::vector<LayoutEntry> sections;
+
+   // PT_LOAD segments, only planned when Rpl::programHeaders is set
+   uint32_t programHeadersOffset = 0;
+   std::vector<elf::ProgramHeader> programHeaders;
+
+   // Offset of the end of the last thing in the file
+   uint32_t fileSize = 0;
 };
 
 struct Rpl
@@ -15,8 +193,128 @@ struct Rpl
    elf::Header header;
    uint32_t fileSize;
    std::vector<Section> sections;
+   InputFile input;
+   Layout layout;
+   ConvertStats stats;
+
+   // Address relocateImports moves the import sections to
+   uint32_t importsAddress = DefaultImportsAddress;
+
+   // Lay the loaded sections out as they are in memory and describe them
+   // with PT_LOAD segments
+   bool programHeaders = false;
+
+   // StripPolicy mask of the sections stripSections removes
+   uint32_t strip = 0;
+
+   // Write sections as SHF_COMPRESSED, see compressOutputSections
+   bool compressSections = false;
+   bool compressAllSections = false;
+   CompressorType sectionCompressor = CompressorType::Zlib;
+   int sectionCompressionLevel = 6;
+
+   // With a non-zero budget readRpl only loads the sections the later
+   // stages rewrite and fails if those need more than this many bytes,
+   // together with the largest lazily inflated section for an engine which
+   // cannot stream. compressOutputSections works through the sections in
+   // batches which fit in it next to the contents already held, and fails
+   // if a single section does not.
+   size_t memoryBudget = 0;
+
+   // Used for sections inflated after readRpl
+   DecompressorType decompressorType = DecompressorType::Zlib;
+   std::unique_ptr<Decompressor> decompressor;
 };
 
 uint32_t
 getSectionIndex(const Rpl &rpl,
                 const Section &section);
+
+// Conversion stages, in the order they are run. Each one prints the reason
+// it failed and returns false on error.
+
+// Read the section headers and contents of path. Deflated sections the
+// later stages rewrite are inflated with up to jobs threads, the rest are
+// left compressed until needed.
+bool
+readRpl(Rpl &rpl,
+        const std::string &path,
+        bool map,
+        DecompressorType decompressorType,
+        unsigned jobs);
+
+// Same as above for a file already in memory, data is used in place and
+// must stay valid as long as rpl
+bool
+readRpl(Rpl &rpl,
+        const void *data,
+        size_t size,
+        DecompressorType decompressorType,
+        unsigned jobs);
+
+// Read an .elf such as one written by writeElf. SHF_DEFLATED is ignored,
+// the conversion leaves it set on sections it inflated, so every section is
+// read as stored.
+bool
+readElf(Rpl &rpl,
+        const std::string &path,
+        bool map);
+
+// Load a section readRpl left compressed or deferred, does nothing for
+// other sections
+bool
+loadSection(Rpl &rpl,
+            Section &section);
+
+// Optional, run right after readRpl. Check every section against the CRCs
+// in SHT_RPL_CRCS with up to jobs threads, each mismatch is reported.
+bool
+verifyCrcs(Rpl &file,
+           unsigned jobs);
+
+bool
+decodeTables(Rpl &file);
+
+bool
+fixFileHeader(Rpl &file);
+
+bool
+fixRelocations(Rpl &file);
+
+bool
+relocateImports(Rpl &file);
+
+// Optional, run between relocateImports and encodeTables while the symbol
+// tables are decoded. Removes the sections selected by file.strip and
+// renumbers the rest, fixing up shstrndx, sh_link, the sh_info of
+// relocation sections and symbol st_shndx.
+bool
+stripSections(Rpl &file);
+
+bool
+encodeTables(Rpl &file);
+
+// Optional, run after encodeTables. Compresses the non-alloc SHT_PROGBITS
+// sections, or every section with contents when file.compressAllSections
+// is set, into standard SHF_COMPRESSED sections with up to jobs threads.
+// The section name table, SHT_RPL_CRCS and SHT_RPL_FILEINFO are left as
+// they are, as are SHF_ALLOC sections when file.programHeaders is set.
+bool
+compressOutputSections(Rpl &file,
+                       unsigned jobs);
+
+bool
+calculateSectionOffsets(Rpl &file);
+
+bool
+writeElf(Rpl &file,
+         const std::string &filename);
+
+bool
+writeElf(Rpl &file,
+         std::vector<char> &output);
+
+// Write to a stream which cannot seek, in increasing offset order
+bool
+writeElf(Rpl &file,
+         std::FILE *output);
@@ -0,0 +1,36 @@
+#pragma once
+#include "converter.h"
+#include <string>
+
+// Conversions served over a Unix domain socket by a long running process,
+// so callers converting many small files do not start a process for each.
+//
+// The client opens the input and output itself and passes the descriptors
+// with its request, so paths are resolved and permissions checked on the
+// client's side. Messages printed while converting go to the server's
+// output, the client only learns whether the conversion succeeded.
+
+// Serve conversions on socketPath with jobs worker threads, each converting
+// one file at a time. Only returns if the socket could not be set up.
+bool
+runServer(const std::string &socketPath,
+          const ConverterOptions &options,
+          unsigned jobs);
+
+enum class RemoteResult
+{
+   Converted,
+   Failed,
+
+   // No server could be reached, nothing was done
+   Unavailable,
+};
+
+// Have the server on socketPath convert input into output. The options
+// which change the output are sent along with --verify, --inflate and
+// --memory-budget, the server's own are used for the rest.
+RemoteResult
+convertRemote(const std::string &socketPath,
+              int input,
+              int output,
+              const ConverterOptions &options);
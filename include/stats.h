@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class StatsFormat
+{
+   Text,
+   Json,
+};
+
+struct StageStats
+{
+   std::string name;
+   double milliseconds;
+
+   // Peak resident set size of the process once the stage finished
+   uint64_t peakRss;
+};
+
+// Counters collected while converting one file, the stage timings are
+// only filled in when --stats is given
+struct ConvertStats
+{
+   // readRpl
+   uint64_t bytesRead = 0;
+   uint64_t bytesInflated = 0;
+
+   // fixRelocations: relocations kept as is, R_PPC_REL32 made from a pair
+   // of GHS_REL16 halves (two input relocations each), and unknown or
+   // unpaired relocations which were dropped. Empty entries are not counted.
+   uint64_t relocationsKept = 0;
+   uint64_t relocationsConverted = 0;
+   uint64_t relocationsDropped = 0;
+
+   // relocateImports
+   uint64_t symbolsRelocated = 0;
+
+   // writeElf
+   uint64_t bytesWritten = 0;
+
+   std::vector<StageStats> stages;
+};
+
+// Peak resident set size of the process in bytes, 0 if unknown
+uint64_t
+getPeakRss();
+
+bool
+parseStatsFormat(const std::string &name,
+                 StatsFormat &format);
+
+std::string
+formatStats(const std::string &path,
+            const ConvertStats &stats,
+            StatsFormat format);
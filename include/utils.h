@@ -20,6 +20,11 @@
 #include <byteswap.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BYTE_SWAP_X86_SIMD
+#include <immintrin.h>
+#endif
+
 // reinterpret_cast for value types
 template<typename DstType, typename SrcType>
 inline DstType
@@ -116,6 +121,74 @@ byte_swap(Type src)
    return byte_swap_t<Type>::swap(src);
 }
 
+// Bulk byte swapping of arrays of 32-bit words.
+//
+// Used to convert whole tables of big endian structures to native layout
+// in one go, instead of swapping every field on access through be_val.
+// On x86 the widest supported shuffle is picked at runtime.
+#ifdef BYTE_SWAP_X86_SIMD
+__attribute__((target("avx2")))
+static inline size_t
+byte_swap_words_avx2(char *dst, const char *src, size_t count)
+{
+   const auto mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+   auto i = size_t { 0 };
+
+   for (; i + 8 <= count; i += 8) {
+      auto words = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4), _mm256_shuffle_epi8(words, mask));
+   }
+
+   return i;
+}
+
+__attribute__((target("ssse3")))
+static inline size_t
+byte_swap_words_ssse3(char *dst, const char *src, size_t count)
+{
+   const auto mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+   auto i = size_t { 0 };
+
+   for (; i + 4 <= count; i += 4) {
+      auto words = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), _mm_shuffle_epi8(words, mask));
+   }
+
+   return i;
+}
+#endif
+
+// Swaps the endian of count 32-bit words from src into dst, which may be
+// the same buffer. Neither buffer needs to be aligned.
+inline void
+byte_swap_words(void *dstPtr, const void *srcPtr, size_t count)
+{
+   auto dst = reinterpret_cast<char *>(dstPtr);
+   auto src = reinterpret_cast<const char *>(srcPtr);
+   auto i = size_t { 0 };
+
+#ifdef BYTE_SWAP_X86_SIMD
+   static const auto level = []() {
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2") ? 2 : (__builtin_cpu_supports("ssse3") ? 1 : 0);
+   }();
+
+   if (level == 2) {
+      i = byte_swap_words_avx2(dst, src, count);
+   } else if (level == 1) {
+      i = byte_swap_words_ssse3(dst, src, count);
+   }
+#endif
+
+   for (; i < count; ++i) {
+      uint32_t word;
+      std::memcpy(&word, src + i * 4, sizeof(uint32_t));
+      word = byte_swap(word);
+      std::memcpy(dst + i * 4, &word, sizeof(uint32_t));
+   }
+}
+
 // Alignment helpers
 template<typename Type>
 constexpr inline Type
@@ -0,0 +1,115 @@
+#include "input_file.h"
+#include "utils.h"
+
+#ifdef PLATFORM_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+
+InputFile::~InputFile()
+{
+   close();
+}
+
+bool
+InputFile::open(const std::string &path, bool map)
+{
+   close();
+
+#ifdef PLATFORM_POSIX
+   if (map) {
+      auto fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+         return false;
+      }
+
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+         auto mapping = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+         if (mapping != MAP_FAILED) {
+            mMapping = reinterpret_cast<const char *>(mapping);
+            mOwnsMapping = true;
+            mSize = static_cast<size_t>(st.st_size);
+         }
+      }
+
+      ::close(fd);
+
+      if (mMapping) {
+         return true;
+      }
+
+      // Fall back to stream reads for anything we could not map
+   }
+#endif
+
+   mStream.open(path, std::ifstream::binary);
+   if (!mStream.is_open()) {
+      return false;
+   }
+
+   mStream.seekg(0, std::ios::end);
+   mSize = static_cast<size_t>(mStream.tellg());
+   mStream.seekg(0, std::ios::beg);
+   return true;
+}
+
+void
+InputFile::openMemory(const void *data, size_t size)
+{
+   close();
+   mMapping = reinterpret_cast<const char *>(data);
+   mSize = size;
+}
+
+void
+InputFile::close()
+{
+#ifdef PLATFORM_POSIX
+   if (mMapping && mOwnsMapping) {
+      munmap(const_cast<char *>(mMapping), mSize);
+   }
+#endif
+
+   if (mStream.is_open()) {
+      mStream.close();
+   }
+
+   mMapping = nullptr;
+   mOwnsMapping = false;
+   mSize = 0;
+}
+
+bool
+InputFile::read(size_t offset, void *dst, size_t size)
+{
+   if (!contains(offset, size)) {
+      return false;
+   }
+
+   if (mMapping) {
+      std::memcpy(dst, mMapping + offset, size);
+      return true;
+   }
+
+   std::lock_guard<std::mutex> lock { mStreamMutex };
+   mStream.clear();
+   mStream.seekg(offset);
+   mStream.read(reinterpret_cast<char *>(dst), size);
+   return static_cast<size_t>(mStream.gcount()) == size;
+}
+
+const char *
+InputFile::view(size_t offset, size_t size) const
+{
+   if (!mMapping || !contains(offset, size)) {
+      return nullptr;
+   }
+
+   return mMapping + offset;
+}
@@ -1,536 +1,450 @@
-#include "elf.h"
+#include "cache.h"
+#include "converter.h"
+#include "decompressor.h"
+#include "packer.h"
+#include "parallel.h"
 #include "rpl2elf.h"
+#include "server.h"
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
 #include <excmd.h>
+#include <filesystem>
 #include <fmt/format.h>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <system_error>
 #include <vector>
-#include <zlib.h>
 
-auto elfImportsRelocationAddress = 0x01000000;
+#ifdef PLATFORM_POSIX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-uint32_t
-getSectionIndex(const Rpl &rpl,
-					 const Section &section)
+struct ConvertOptions
 {
-	return static_cast<uint32_t>(&section - &rpl.sections[0]);
-}
-
-
-bool
-readSection(std::ifstream &fh,
-				Section &section,
-				size_t i)
-{
-	// Read section header
-	fh.read(reinterpret_cast<char*>(&section.header), sizeof(elf::SectionHeader));
-
-	if (section.header.type == elf::SHT_NOBITS || !section.header.size) {
-		return true;
-	}
-
-	// Read section data
-	if (section.header.flags & elf::SHF_DEFLATED) {
-		auto stream = z_stream {};
-		auto ret = Z_OK;
-
-		// Read the original size
-		uint32_t size = 0;
-		fh.seekg(section.header.offset.value());
-		fh.read(reinterpret_cast<char *>(&size), sizeof(uint32_t));
-		size = byte_swap(size);
-		section.data.resize(size);
-
-		// Inflate
-		memset(&stream, 0, sizeof(stream));
-		stream.zalloc = Z_NULL;
-		stream.zfree = Z_NULL;
-		stream.opaque = Z_NULL;
-
-		ret = inflateInit(&stream);
-
-		if (ret != Z_OK) {
-			fmt::print("Couldn't decompress .rpx section because inflateInit returned {}\n", ret);
-			section.data.clear();
-			return false;
-		} else {
-			std::vector<char> temp;
-			temp.resize(section.header.size-sizeof(uint32_t));
-			fh.read(temp.data(), temp.size());
+	ConverterOptions converter;
+	bool stats = false;
+	StatsFormat statsFormat = StatsFormat::Text;
+	std::string cacheDir;
 
-			stream.avail_in = section.header.size;
-			stream.next_in = reinterpret_cast<Bytef *>(temp.data());
-			stream.avail_out = static_cast<uInt>(section.data.size());
-			stream.next_out = reinterpret_cast<Bytef *>(section.data.data());
+	// Socket of a server started with --serve to hand conversions to
+	std::string server;
 
-			ret = inflate(&stream, Z_FINISH);
+	// Where a dst of "-" is written, stdout unless it was redirected
+	std::FILE *standardOutput = stdout;
+};
 
-			if (ret != Z_OK && ret != Z_STREAM_END) {
-				fmt::print("Couldn't decompress .rpx section because inflate returned {}\n", ret);
-				section.data.clear();
-				return false;
-			}
+// src or dst standing for stdin or stdout
+static const char StandardStreamPath[] = "-";
 
-			inflateEnd(&stream);
-		}
-	} else {
-		section.data.resize(section.header.size);
-		fh.seekg(section.header.offset.value());
-		fh.read(section.data.data(), section.header.size);
+/**
+ * Describe everything besides the input which changes the output, this is
+ * part of the cache key so entries are never served across versions.
+ */
+static std::string
+getOutputOptionsKey(const ConvertOptions &options)
+{
+	// --verify does not change the output, but an entry stored without it
+	// must not let a corrupt input skip the check
+	auto &converter = options.converter;
+	auto compress = std::string {};
+
+	if (converter.compressSections) {
+		compress = fmt::format(";compress={}:{}{}", static_cast<int>(converter.sectionCompressor),
+									  converter.sectionCompressionLevel, converter.compressAllSections ? ":all" : "");
 	}
 
-	return true;
+	return fmt::format("{};imports={:08X};strip={:X}{}{}{}", ConverterVersion, converter.importsAddress,
+							 converter.strip,
+							 converter.programHeaders ? ";phdrs" : "",
+							 compress,
+							 converter.verify ? ";verify" : "");
 }
 
 /**
- * Read the .rpl file
+ * Parse a --memory-budget size, a number of bytes with an optional K, M or G
+ * suffix.
  */
 static bool
-readRpl(Rpl &rpl, const std::string &path)
+parseMemorySize(const std::string &text,
+					 size_t &size)
 {
-	// Read file
-	std::ifstream fh { path, std::ifstream::binary };
-	if (!fh.is_open()) {
-		fmt::print("Could not open {} for reading\n", path);
+	static const char Suffixes[] = "KMG";
+	auto end = size_t { 0 };
+	auto value = 0ull;
+
+	if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) {
 		return false;
 	}
 
-	fh.read(reinterpret_cast<char*>(&rpl.header), sizeof(elf::Header));
-
-	if (rpl.header.magic != elf::HeaderMagic) {
-		fmt::print("Invalid ELF magic header\n");
+	try {
+		value = std::stoull(text, &end, 10);
+	} catch (std::exception &) {
 		return false;
 	}
-	
-	// Read sections
-	for (auto i = 0u; i < rpl.header.shnum; ++i) {
-		Section section;
-		fh.seekg(rpl.header.shoff + rpl.header.shentsize * i);
 
-		if (!readSection(fh, section, i)) {
-			fmt::print("Error reading section {}", i);
+	auto shift = 0u;
+	if (end != text.size()) {
+		auto suffix = std::strchr(Suffixes, std::toupper(static_cast<unsigned char>(text[end])));
+
+		if (end + 1 != text.size() || !text[end] || !suffix) {
 			return false;
 		}
 
-		rpl.sections.push_back(section);
+		shift = 10u * static_cast<unsigned>(suffix - Suffixes + 1);
 	}
-	
-	// Set section names
-	auto shStrTab = reinterpret_cast<const char *>(rpl.sections[rpl.header.shstrndx].data.data());
-	for (auto &section : rpl.sections) {
-		section.name = shStrTab + section.header.name;
+
+	if (!value || value > (std::numeric_limits<size_t>::max() >> shift)) {
+		return false;
 	}
-	
+
+	size = static_cast<size_t>(value << shift);
 	return true;
 }
 
 /**
- * Fix file header to look like an ELF file!
+ * Parse a comma separated list of --strip policies into a StripPolicy mask.
  */
 static bool
-fixFileHeader(Rpl &file)
+parseStripPolicies(const std::string &policies,
+						 uint32_t &strip)
 {
-	file.header.abi = elf::EABI_NONE;
-	file.header.type = uint16_t { elf::ET_EXEC };
+	strip = 0;
+
+	if (policies.empty()) {
+		fmt::print("Invalid --strip policy {}, expected debug, rpl, empty or all\n", policies);
+		return false;
+	}
+
+	for (auto start = size_t { 0 }; start <= policies.size(); ) {
+		auto end = std::min(policies.find(',', start), policies.size());
+		auto policy = policies.substr(start, end - start);
+
+		if (policy == "debug") {
+			strip |= StripDebug;
+		} else if (policy == "rpl") {
+			strip |= StripRplMetadata;
+		} else if (policy == "empty") {
+			strip |= StripEmpty;
+		} else if (policy == "all") {
+			strip |= StripDebug | StripRplMetadata | StripEmpty;
+		} else {
+			fmt::print("Invalid --strip policy {}, expected debug, rpl, empty or all\n", policy);
+			return false;
+		}
+
+		start = end + 1;
+	}
+
 	return true;
 }
 
 /**
- * Fix relocations.
- * Replace non-standard GHS_REL16 relocations
+ * Read all of stdin, the section headers are at the end of an .rpl so it is
+ * buffered whole.
  */
 static bool
-fixRelocations(Rpl &file)
+readStandardInput(std::vector<char> &input)
 {
-	for (auto &section : file.sections) {
-		std::vector<elf::Rela> newRelocations;
+	const auto BlockSize = size_t { 1024 * 1024 };
+	auto size = size_t { 0 };
 
-		if (section.header.type != elf::SHT_RELA) {
-			continue;
-		}
-
-		// Clear flags
-		section.header.flags = 0u;
-
-		auto &symbolSection = file.sections[section.header.link];
-		auto &targetSection = file.sections[section.header.info];
-
-		auto rels = reinterpret_cast<elf::Rela *>(section.data.data());
-		auto numRels = section.data.size() / sizeof(elf::Rela);
-		for (auto i = 0u; i < numRels; ++i) {
-			auto info = rels[i].info;
-			auto addend = rels[i].addend;
-			auto offset = rels[i].offset;
-			auto index = info >> 8;
-			auto type = info & 0xFF;
-			
-			if (!info && !addend && !offset)
-				continue;
-
-			switch (type) {
-			case elf::R_PPC_NONE:
-			case elf::R_PPC_ADDR32:
-			case elf::R_PPC_ADDR16_LO:
-			case elf::R_PPC_ADDR16_HI:
-			case elf::R_PPC_ADDR16_HA:
-			case elf::R_PPC_REL24:
-			case elf::R_PPC_REL14:
-			case elf::R_PPC_DTPMOD32:
-			case elf::R_PPC_DTPREL32:
-			case elf::R_PPC_EMB_SDA21:
-			case elf::R_PPC_EMB_RELSDA:
-			case elf::R_PPC_DIAB_SDA21_LO:
-			case elf::R_PPC_DIAB_SDA21_HI:
-			case elf::R_PPC_DIAB_SDA21_HA:
-			case elf::R_PPC_DIAB_RELSDA_LO:
-			case elf::R_PPC_DIAB_RELSDA_HI:
-			case elf::R_PPC_DIAB_RELSDA_HA:
-			{
-				// All valid relocations
-				newRelocations.emplace_back();
-				auto &newRel = newRelocations.back();
-				newRel.info = info;
-				newRel.addend = addend;
-				newRel.offset = offset;
-				break;
-			}
-			
-			/*
-			 * Convert two GHS_REL16 into a R_PPC_REL32
-			 */
-			case elf::R_PPC_GHS_REL16_HI:
-			{
-				bool success = false;
-				
-				// Attempt to find an R_PPC_GHS_REL16_LO to make a R_PPC_REL32
-				for (auto j = 0u; j < numRels; ++j) {
-					if (rels[j].info != ((index << 8) | elf::R_PPC_GHS_REL16_LO)) continue;
-					if (rels[j].addend != (addend + 2)) continue;
-					if (rels[j].offset != (offset + 2)) continue;
-					
-					newRelocations.emplace_back();
-					auto &newRel = newRelocations.back();
-
-					newRel.info = (index << 8) | elf::R_PPC_REL32;
-					newRel.addend = addend;
-					newRel.offset = offset;
-					
-					rels[j].info = 0u;
-					rels[j].addend = 0;
-					rels[j].offset = 0u;
-					
-					//fmt::print("Successfully converted GHS_REL16 group to R_PPC_REL32!\n");
-					success = true;
-				}
-				
-				if (!success)
-					fmt::print("Unsupported relocation found! Unable to fix\n");
-
-				break;
-			}
-			
-			case elf::R_PPC_GHS_REL16_LO:
-			{
-				bool success = false;
-				
-				// Attempt to find an R_PPC_GHS_REL16_HI to make a R_PPC_REL32
-				for (auto j = 0u; j < numRels; ++j) {
-					if (rels[j].info != ((index << 8) | elf::R_PPC_GHS_REL16_HI)) continue;
-					if (rels[j].addend != (addend - 2)) continue;
-					if (rels[j].offset != (offset - 2)) continue;
-					
-					newRelocations.emplace_back();
-					auto &newRel = newRelocations.back();
-
-					newRel.info = (index << 8) | elf::R_PPC_REL32;
-					newRel.addend = addend - 2;
-					newRel.offset = offset - 2;
-					
-					rels[j].info = 0u;
-					rels[j].addend = 0;
-					rels[j].offset = 0u;
-					
-					fmt::print("Successfully converted GHS_REL16 group to R_PPC_REL32!\n");
-					success = true;
-				}
-				
-				if (!success)
-					fmt::print("Unsupported relocation found! Unable to fix\n");
-
-				break;
-			}
+	while (true) {
+		input.resize(size + BlockSize);
+		auto read = std::fread(input.data() + size, 1, BlockSize, stdin);
+		size += read;
 
-			default:
-				fmt::print("Unknown relocation found!\n");
-				break;
-			}
+		if (read < BlockSize) {
+			break;
 		}
+	}
+
+	input.resize(size);
 
-		section.data.clear();
-		section.data.insert(section.data.end(),
-									reinterpret_cast<char *>(newRelocations.data()),
-									reinterpret_cast<char *>(newRelocations.data() + newRelocations.size()));
+	if (std::ferror(stdin)) {
+		fmt::print("Could not read stdin\n");
+		return false;
 	}
 
 	return true;
 }
 
 /**
- * Calculate section file offsets.
+ * Have the server at options.server convert src into dst. Returns
+ * RemoteResult::Unavailable without touching dst when no server is running.
  */
-static bool
-calculateSectionOffsets(Rpl &file)
+static RemoteResult
+convertOnServer(const std::string &src,
+					 const std::string &dst,
+					 const ConvertOptions &options)
 {
-	auto offset = file.header.shoff;
-	offset += align_up(static_cast<uint32_t>(file.sections.size() * sizeof(elf::SectionHeader)), 64);
-
-	for (auto &section : file.sections) {
-		if (section.header.type == elf::SHT_NOBITS ||
-			section.header.type == elf::SHT_NULL) {
-			section.header.offset = 0u;
-			section.data.clear();
-		}
+#ifdef PLATFORM_POSIX
+	auto fromStdin = (src == StandardStreamPath);
+	auto toStdout = (dst == StandardStreamPath);
+
+	auto input = fromStdin ? STDIN_FILENO : open(src.c_str(), O_RDONLY | O_CLOEXEC);
+	if (input < 0) {
+		fmt::print("Could not open {} for reading\n", src);
+		return RemoteResult::Failed;
 	}
 
-	for (auto &section : file.sections) {
-		if (section.header.type == elf::SHT_RPL_CRCS) {
-			section.header.offset = offset;
-			section.header.size = static_cast<uint32_t>(section.data.size());
-			offset += section.header.size;
-		}
-	}
+	// The output is opened in a temporary file next to dst, so dst is left
+	// alone when no server answers and a cache hardlink is never truncated
+	auto output = -1;
+	auto tempPath = dst + ".XXXXXX";
 
-	for (auto &section : file.sections) {
-		if (section.header.type == elf::SHT_RPL_FILEINFO) {
-			section.header.offset = offset;
-			section.header.size = static_cast<uint32_t>(section.data.size());
-			offset += section.header.size;
+	if (toStdout) {
+		std::fflush(options.standardOutput);
+		output = fileno(options.standardOutput);
+	} else {
+		output = mkstemp(&tempPath[0]);
+		if (output >= 0) {
+			fchmod(output, 0644);
 		}
 	}
 
-	// First the "dataMin / dataMax" sections, which are:
-	// - !(flags & SHF_EXECINSTR)
-	// - flags & SHF_WRITE
-	// - flags & SHF_ALLOC
-	for (auto &section : file.sections) {
-		if (section.header.size == 0 ||
-			section.header.type == elf::SHT_RPL_FILEINFO ||
-			section.header.type == elf::SHT_RPL_IMPORTS ||
-			section.header.type == elf::SHT_RPL_CRCS ||
-			section.header.type == elf::SHT_NOBITS) {
-			continue;
-		}
+	auto result = RemoteResult::Failed;
+	if (output < 0) {
+		fmt::print("Could not open {} for writing\n", dst);
+	} else {
+		result = convertRemote(options.server, input, output, options.converter);
 
-		if (!(section.header.flags & elf::SHF_EXECINSTR) &&
-			  (section.header.flags & elf::SHF_WRITE) &&
-			  (section.header.flags & elf::SHF_ALLOC)) {
-			section.header.offset = offset;
-			section.header.size = static_cast<uint32_t>(section.data.size());
-			offset += section.header.size;
+		if (result == RemoteResult::Failed) {
+			fmt::print("ERROR: {} failed to convert on the server, see its output.\n", src);
 		}
 	}
 
-	// Next the "readMin / readMax" sections, which are:
-	// - !(flags & SHF_EXECINSTR) || type == SHT_RPL_EXPORTS
-	// - !(flags & SHF_WRITE)
-	// - flags & SHF_ALLOC
-	for (auto &section : file.sections) {
-		if (section.header.size == 0 ||
-			 section.header.type == elf::SHT_RPL_FILEINFO ||
-			 section.header.type == elf::SHT_RPL_IMPORTS ||
-			 section.header.type == elf::SHT_RPL_CRCS ||
-			 section.header.type == elf::SHT_NOBITS) {
-			continue;
-		}
-
-		if ((!(section.header.flags & elf::SHF_EXECINSTR) ||
-				 section.header.type == elf::SHT_RPL_EXPORTS) &&
-			 !(section.header.flags & elf::SHF_WRITE) &&
-			  (section.header.flags & elf::SHF_ALLOC)) {
-			section.header.offset = offset;
-			section.header.size = static_cast<uint32_t>(section.data.size());
-			offset += section.header.size;
-		}
+	if (!fromStdin) {
+		close(input);
 	}
 
-	// Import sections are part of the read sections, but have execinstr flag set
-	// so let's insert them here to avoid complicating the above logic.
-	for (auto &section : file.sections) {
-		if (section.header.type == elf::SHT_RPL_IMPORTS) {
-			section.header.offset = offset;
-			section.header.size = static_cast<uint32_t>(section.data.size());
-			offset += section.header.size;
+	if (!toStdout && output >= 0) {
+		close(output);
+
+		if (result != RemoteResult::Converted || std::rename(tempPath.c_str(), dst.c_str()) != 0) {
+			unlink(tempPath.c_str());
 		}
 	}
 
-	// Next the "textMin / textMax" sections, which are:
-	// - flags & SHF_EXECINSTR
-	// - type != SHT_RPL_EXPORTS
-	for (auto &section : file.sections) {
-		if (section.header.size == 0 ||
-			 section.header.type == elf::SHT_RPL_FILEINFO ||
-			 section.header.type == elf::SHT_RPL_IMPORTS ||
-			 section.header.type == elf::SHT_RPL_CRCS ||
-			 section.header.type == elf::SHT_NOBITS) {
-			continue;
+	return result;
+#else
+	return RemoteResult::Unavailable;
+#endif
+}
+
+/**
+ * Convert a single .rpl file to an .elf file, src and dst may be "-" for
+ * stdin and stdout.
+ */
+static bool
+convert(const std::string &src,
+		  const std::string &dst,
+		  const ConvertOptions &options)
+{
+	auto fromStdin = (src == StandardStreamPath);
+	auto toStdout = (dst == StandardStreamPath);
+
+	auto printStats = [&](const ConvertStats &stats) {
+		// Stats go to stderr so they can be separated from the messages above
+		if (options.stats) {
+			auto text = formatStats(src, stats, options.statsFormat);
+			std::fwrite(text.data(), 1, text.size(), stderr);
 		}
+	};
 
-		if ((section.header.flags & elf::SHF_EXECINSTR) &&
-			  section.header.type != elf::SHT_RPL_EXPORTS) {
-			section.header.offset = offset;
-			section.header.size = static_cast<uint32_t>(section.data.size());
-			offset += section.header.size;
+	auto cacheKey = std::string {};
+	auto cacheLookup = StageStats {};
+
+	// The cache is keyed and filled by path, so streams bypass it
+	if (!options.cacheDir.empty() && !fromStdin && !toStdout) {
+		auto start = std::chrono::steady_clock::now();
+		cacheKey = getCacheKey(src, getOutputOptionsKey(options));
+
+		auto hit = !cacheKey.empty() && fetchCachedOutput(options.cacheDir, cacheKey, dst);
+		auto time = std::chrono::duration<double, std::milli> { std::chrono::steady_clock::now() - start };
+		cacheLookup = { "cacheLookup", time.count(), getPeakRss() };
+
+		if (hit) {
+			auto stats = ConvertStats {};
+			stats.stages.push_back(cacheLookup);
+			printStats(stats);
+			return true;
 		}
 	}
 
-	// Next the "tempMin / tempMax" sections, which are:
-	// - !(flags & SHF_EXECINSTR)
-	// - !(flags & SHF_ALLOC)
-	for (auto &section : file.sections) {
-		if (section.header.size == 0 ||
-			 section.header.type == elf::SHT_RPL_FILEINFO ||
-			 section.header.type == elf::SHT_RPL_IMPORTS ||
-			 section.header.type == elf::SHT_RPL_CRCS ||
-			 section.header.type == elf::SHT_NOBITS) {
-			continue;
-		}
+	auto converterOptions = options.converter;
+	converterOptions.stageStats = options.stats;
 
-		if (!(section.header.flags & elf::SHF_EXECINSTR) &&
-			 !(section.header.flags & elf::SHF_ALLOC)) {
-			section.header.offset = offset;
-			section.header.size = static_cast<uint32_t>(section.data.size());
-			offset += section.header.size;
-		}
+	auto converter = Converter { converterOptions };
+	auto result = false;
+	auto remote = RemoteResult::Unavailable;
+
+	// Without a server running the file is converted here
+	if (!options.server.empty()) {
+		remote = convertOnServer(src, dst, options);
+		result = (remote == RemoteResult::Converted);
 	}
 
-	auto index = 0u;
-	for (auto &section : file.sections) {
-		if (section.header.offset == 0 &&
-			 section.header.type != elf::SHT_NULL &&
-			 section.header.type != elf::SHT_NOBITS) {
-			fmt::print("Failed to calculate offset for section {}\n", index);
+	if (remote != RemoteResult::Unavailable) {
+		// Converted or failed on the server
+	} else if (fromStdin) {
+		std::vector<char> input;
+
+		if (!readStandardInput(input)) {
 			return false;
 		}
 
-		++index;
+		result = toStdout ? converter.convert(input.data(), input.size(), options.standardOutput)
+								: converter.convert(input.data(), input.size(), dst);
+	} else {
+		result = toStdout ? converter.convert(src, options.standardOutput)
+								: converter.convert(src, dst);
+	}
+
+	if (!result) {
+		return false;
+	}
+
+	// A conversion which cannot be cached still succeeded
+	auto error = std::string {};
+	if (!cacheKey.empty() && !storeCachedOutput(options.cacheDir, cacheKey, dst, error)) {
+		fmt::print("Could not add {} to the cache: {}\n", dst, error);
+	}
+
+	auto stats = converter.stats();
+	if (!cacheKey.empty()) {
+		stats.stages.insert(stats.stages.begin(), cacheLookup);
 	}
 
+	printStats(stats);
 	return true;
 }
 
 /**
- * Write out the final ELF.
+ * Returns true if path looks like an .rpl or .rpx file.
  */
 static bool
-writeElf(Rpl &file, const std::string &filename)
+isRplPath(const std::filesystem::path &path)
 {
-	auto shoff = file.header.shoff;
+	auto extension = path.extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension == ".rpl" || extension == ".rpx";
+}
 
-	// Write the file out
-	std::ofstream out { filename, std::ofstream::binary };
+/**
+ * Add an input to a batch, directories add every .rpl / .rpx inside them.
+ */
+static bool
+addBatchInput(std::vector<std::string> &inputs,
+				  const std::string &path)
+{
+	auto error = std::error_code {};
 
-	if (!out.is_open()) {
-		fmt::print("Could not open {} for writing\n", filename);
-		return false;
+	if (!std::filesystem::is_directory(path, error)) {
+		inputs.push_back(path);
+		return true;
 	}
 
-	// Write file header
-	out.seekp(0, std::ios::beg);
-	out.write(reinterpret_cast<const char *>(&file.header), sizeof(elf::Header));
-
-	// Write section headers
-	out.seekp(shoff, std::ios::beg);
-	for (const auto &section : file.sections) {
-		out.write(reinterpret_cast<const char *>(&section.header), sizeof(elf::SectionHeader));
+	std::vector<std::string> files;
+	for (auto &entry : std::filesystem::directory_iterator { path, error }) {
+		if (entry.is_regular_file(error) && isRplPath(entry.path())) {
+			files.push_back(entry.path().string());
+		}
 	}
 
-	// Write sections
-	for (const auto &section : file.sections) {
-		if (section.data.size()) {
-			out.seekp(section.header.offset, std::ios::beg);
-			out.write(section.data.data(), section.data.size());
-		}
+	if (error) {
+		fmt::print("Could not read directory {}: {}\n", path, error.message());
+		return false;
 	}
 
+	std::sort(files.begin(), files.end());
+	inputs.insert(inputs.end(), files.begin(), files.end());
 	return true;
 }
 
 /**
- * Relocate a section to a new address.
+ * Add every input listed in a manifest file, one path per line.
  */
 static bool
-relocateSection(Rpl &file,
-					 Section &section,
-					 uint32_t sectionIndex,
-					 uint32_t newSectionAddress)
+readBatchManifest(std::vector<std::string> &inputs,
+						const std::string &path)
 {
-	auto sectionSize = section.data.size() ? section.data.size() : static_cast<size_t>(section.header.size);
-	auto oldSectionAddress = section.header.addr;
-	auto oldSectionAddressEnd = section.header.addr + sectionSize;
-
-	// Relocate symbols pointing into this section
-	for (auto &symSection : file.sections) {
-		if (symSection.header.type != elf::SectionType::SHT_SYMTAB) {
-			continue;
-		}
-
-		auto symbols = reinterpret_cast<elf::Symbol *>(symSection.data.data());
-		auto numSymbols = symSection.data.size() / sizeof(elf::Symbol);
-		for (auto i = 0u; i < numSymbols; ++i) {
-			auto type = symbols[i].info & 0xf;
-			auto value = symbols[i].value;
-
-			// Only relocate data, func, section symbols
-			if (type != elf::STT_OBJECT &&
-				 type != elf::STT_FUNC &&
-				 type != elf::STT_SECTION) {
-				continue;
-			}
-
-			if (value >= oldSectionAddress && value <= oldSectionAddressEnd) {
-				symbols[i].value = (value - oldSectionAddress) + newSectionAddress;
-			}
-		}
+	std::ifstream fh { path };
+	if (!fh.is_open()) {
+		fmt::print("Could not open manifest {} for reading\n", path);
+		return false;
 	}
 
-	// Relocate relocations pointing into this section
-	for (auto &relaSection : file.sections) {
-		if (relaSection.header.type != elf::SectionType::SHT_RELA ||
-			 relaSection.header.info != sectionIndex) {
+	for (std::string line; std::getline(fh, line); ) {
+		line = trim(line);
+
+		if (line.empty() || line[0] == '#') {
 			continue;
 		}
 
-		auto rela = reinterpret_cast<elf::Rela *>(relaSection.data.data());
-		auto numRelas = relaSection.data.size() / sizeof(elf::Rela);
-		for (auto i = 0u; i < numRelas; ++i) {
-			auto offset = rela[i].offset;
-
-			if (offset >= oldSectionAddress && offset <= oldSectionAddressEnd) {
-				rela[i].offset = (offset - oldSectionAddress) + newSectionAddress;
-			}
+		if (!addBatchInput(inputs, line)) {
+			return false;
 		}
 	}
 
-	section.header.addr = newSectionAddress;
 	return true;
 }
 
-bool relocateImports(Rpl &file)
+/**
+ * Convert many files into outputDir, several files at a time.
+ *
+ * A failing file is reported and does not stop the rest of the batch.
+ */
+static bool
+convertBatch(const std::vector<std::string> &inputs,
+				 const std::string &outputDir,
+				 const ConvertOptions &options,
+				 unsigned jobs)
 {
-	auto newLoc = elfImportsRelocationAddress;
-
-	// Relocate .symtab and .strtab to be in loader memory
-	for (auto i = 0u; i < file.sections.size(); ++i) {
-		auto &section = file.sections[i];
-		if (section.header.type == elf::SHT_RPL_IMPORTS) {
-			relocateSection(file, section, i, align_up(newLoc, section.header.addralign));
-			section.header.flags |= elf::SHF_ALLOC;
-			newLoc += section.data.size();
+	auto error = std::error_code {};
+	std::filesystem::create_directories(outputDir, error);
+
+	if (error) {
+		fmt::print("Could not create output directory {}: {}\n", outputDir, error.message());
+		return false;
+	}
+
+	// Inputs which would overwrite the output of an earlier input are skipped
+	std::vector<std::string> outputs;
+	std::map<std::string, size_t> outputOwners;
+	for (auto i = 0u; i < inputs.size(); ++i) {
+		auto name = std::filesystem::path { inputs[i] }.filename().replace_extension(".elf");
+		auto output = (std::filesystem::path { outputDir } / name).string();
+
+		if (!outputOwners.emplace(output, i).second) {
+			fmt::print("{}: output {} is already written for {}\n", inputs[i], output, inputs[outputOwners[output]]);
+			output.clear();
 		}
+
+		outputs.push_back(output);
 	}
 
-	return true;
+	std::vector<char> succeeded(inputs.size(), 0);
+	parallel_for(inputs.size(), jobs, [&](size_t i, unsigned) {
+		succeeded[i] = !outputs[i].empty() && convert(inputs[i], outputs[i], options);
+
+		if (succeeded[i]) {
+			fmt::print("{}: converted to {}\n", inputs[i], outputs[i]);
+		} else {
+			fmt::print("{}: FAILED\n", inputs[i]);
+		}
+	});
+
+	auto numSucceeded = std::count(succeeded.begin(), succeeded.end(), 1);
+	fmt::print("Converted {} of {} files\n", numSucceeded, inputs.size());
+	return static_cast<size_t>(numSucceeded) == inputs.size();
 }
 
 int main(int argc, char **argv)
@@ -543,15 +457,74 @@ int main(int argc, char **argv)
 	try {
 		parser.global_options()
 			.add_option("H,help",
-							description { "Show help." });
+							description { "Show help." })
+			.add_option("mmap",
+							description { "Map the input file into memory instead of reading it." })
+			.add_option("j,jobs",
+							description { "Number of threads used to decompress sections, or files in batch mode." },
+							value<unsigned> {})
+			.add_option("inflate",
+							description { "Decompression engine used for compressed sections." },
+							value<std::string> {},
+							excmd::allowed<std::string> { availableDecompressors() },
+							excmd::default_value<std::string> { "zlib" })
+			.add_option("o,output-dir",
+							description { "Batch mode, convert every input into this directory." },
+							value<std::string> {})
+			.add_option("manifest",
+							description { "Batch mode, file listing one input path per line." },
+							value<std::string> {})
+			.add_option("stats",
+							description { "Print per stage timings and counters to stderr." })
+			.add_option("stats-format",
+							description { "Format of --stats output." },
+							value<std::string> {},
+							excmd::allowed<std::string> { { "text", "json" } },
+							excmd::default_value<std::string> { "text" })
+			.add_option("imports-address",
+							description { "Address the import sections are relocated to, 0x01000000 by default." },
+							value<std::string> {})
+			.add_option("cache-dir",
+							description { "Reuse outputs of earlier conversions of identical inputs stored in this directory." },
+							value<std::string> {})
+			.add_option("program-headers",
+							description { "Add PT_LOAD program headers, placing loaded sections so each segment can be mapped directly." })
+			.add_option("strip",
+							description { "Remove sections, a comma separated list of: debug (non-alloc debug sections), rpl (CRCs and fileinfo), empty (sections without contents nothing refers to), all." },
+							value<std::string> {})
+			.add_option("compress-sections",
+							description { "Write large non-alloc sections as standard SHF_COMPRESSED sections with this compressor." },
+							value<std::string> {},
+							excmd::allowed<std::string> { availableCompressors() })
+			.add_option("compress-all-sections",
+							description { "With --compress-sections, compress every section with contents but the section names and RPL metadata. Not standard for SHF_ALLOC sections, which are left uncompressed with --program-headers." })
+			.add_option("verify",
+							description { "Check every section against the CRCs stored in the file before converting." })
+			.add_option("memory-budget",
+							description { "Bytes of section contents each conversion may hold in memory, with an optional K, M or G suffix. Other sections are copied from the input as they are written. --inflate=libdeflate inflates them whole, so the largest compressed section counts against the budget too." },
+							value<std::string> {})
+			.add_option("serve",
+							description { "Serve conversions on this Unix socket with --jobs workers until killed." },
+							value<std::string> {})
+			.add_option("server",
+							description { "Hand the conversion to the --serve process on this Unix socket, converting here if none is running." },
+							value<std::string> {})
+			.add_option("pack",
+							description { "Pack an elf converted by rpl2elf back into an rpx." })
+			.add_option("level",
+							description { "Level sections are compressed with by --pack and --compress-sections, up to 9 for zlib and 22 for zstd." },
+							value<unsigned> {},
+							excmd::default_value<unsigned> { 6 });
 
 		parser.default_command()
 			.add_argument("src",
-							  description { "Path to input elf file" },
-							  value<std::string> {})
+							  description { "Path to input rpl file, - for stdin" },
+							  value<std::string> {},
+							  excmd::optional {})
 			.add_argument("dst",
-							  description { "Path to output rpl file" },
-							  value<std::string> {});
+							  description { "Path to output elf file, - for stdout" },
+							  value<std::string> {},
+							  excmd::optional {});
 
 		options = parser.parse(argc, argv);
 	} catch (excmd::exception ex) {
@@ -559,47 +532,181 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	auto batch = options.has("output-dir");
+
 	if (options.empty()
 		 || options.has("help")
-		 || !options.has("src")
-		 || !options.has("dst")) {
+		 || (!batch && !options.has("serve") && (!options.has("src") || !options.has("dst")))) {
 		fmt::print("{} <options> src dst\n", argv[0]);
+		fmt::print("{} <options> --output-dir=<dir> [--manifest=<file>] src...\n", argv[0]);
+		fmt::print("{} --pack [--level=<0-9>] src.elf dst.rpx\n", argv[0]);
+		fmt::print("{} <options> --serve=<socket>\n", argv[0]);
 		fmt::print("{}\n", parser.format_help(argv[0]));
 		return 0;
 	}
 
-	auto src = options.get<std::string>("src");
-	auto dst = options.get<std::string>("dst");
+	auto jobs = options.has("jobs") ? options.get<unsigned>("jobs") : default_job_count();
+	auto convertOptions = ConvertOptions {};
+	convertOptions.converter.map = options.has("mmap");
+	convertOptions.converter.jobs = jobs;
+	convertOptions.converter.programHeaders = options.has("program-headers");
+	convertOptions.converter.verify = options.has("verify");
+
+	if (options.has("compress-sections")) {
+		convertOptions.converter.compressSections = true;
+		convertOptions.converter.compressAllSections = options.has("compress-all-sections");
+		parseCompressorType(options.get<std::string>("compress-sections"), convertOptions.converter.sectionCompressor);
+	}
 
-	Rpl rpl;
+	// zlib levels go up to 9, zstd ones up to 22
+	auto level = 6;
+	if (options.has("level")) {
+		auto maxLevel = 9u;
 
-	if (!readRpl(rpl, src)) {
-		fmt::print("ERROR: readRpl failed.\n");
-		return -1;
+		if (!options.has("pack") && convertOptions.converter.sectionCompressor == CompressorType::Zstd) {
+			maxLevel = 22u;
+		}
+
+		if (options.get<unsigned>("level") > maxLevel) {
+			fmt::print("Invalid --level {}\n", options.get<unsigned>("level"));
+			return -1;
+		}
+
+		level = static_cast<int>(options.get<unsigned>("level"));
+		convertOptions.converter.sectionCompressionLevel = level;
 	}
-	
-	if (!fixFileHeader(rpl)) {
-		fmt::print("ERROR: fixFileHeader failed.\n");
+
+	if (options.has("strip") &&
+		 !parseStripPolicies(options.get<std::string>("strip"), convertOptions.converter.strip)) {
 		return -1;
 	}
+	convertOptions.stats = options.has("stats");
 
-	if (!fixRelocations(rpl)) {
-		fmt::print("ERROR: fixRelocations failed.\n");
-		return -1;
+	if (options.has("cache-dir")) {
+		convertOptions.cacheDir = options.get<std::string>("cache-dir");
 	}
-	
-	if (!relocateImports(rpl)) {
-		fmt::print("ERROR: relocateImports failed.\n");
-		return -1;
+
+	if (options.has("imports-address")) {
+		auto address = options.get<std::string>("imports-address");
+
+		auto end = size_t { 0 };
+		auto value = 0ull;
+
+		try {
+			value = std::stoull(address, &end, 0);
+		} catch (std::exception &) {
+			end = 0;
+		}
+
+		if (!end || end != address.size() || value > 0xFFFFFFFFull) {
+			fmt::print("Invalid --imports-address {}\n", address);
+			return -1;
+		}
+
+		convertOptions.converter.importsAddress = static_cast<uint32_t>(value);
 	}
-	
-	if (!calculateSectionOffsets(rpl)) {
-		fmt::print("ERROR: calculateSectionOffsets failed.\n");
+
+	if (options.has("memory-budget") &&
+		 !parseMemorySize(options.get<std::string>("memory-budget"), convertOptions.converter.memoryBudget)) {
+		fmt::print("Invalid --memory-budget {}\n", options.get<std::string>("memory-budget"));
 		return -1;
 	}
-	
-	if (!writeElf(rpl, dst)) {
-		fmt::print("ERROR: writeElf failed.\n");
+
+	if (options.has("stats-format")) {
+		parseStatsFormat(options.get<std::string>("stats-format"), convertOptions.statsFormat);
+	}
+
+	if (options.has("inflate")) {
+		parseDecompressorType(options.get<std::string>("inflate"), convertOptions.converter.decompressorType);
+	}
+
+	if (options.has("server")) {
+		// The counters of a conversion on the server stay in the server
+		if (convertOptions.stats) {
+			fmt::print("--stats does not support --server\n");
+			return -1;
+		}
+
+		convertOptions.server = options.get<std::string>("server");
+	}
+
+	if (options.has("serve")) {
+		// Each worker converts one file at a time
+		auto serverOptions = convertOptions.converter;
+		serverOptions.jobs = 1;
+		return runServer(options.get<std::string>("serve"), serverOptions, jobs) ? 0 : -1;
+	}
+
+	if (options.has("pack")) {
+		auto packOptions = PackOptions {};
+		packOptions.map = convertOptions.converter.map;
+		packOptions.jobs = jobs;
+
+		packOptions.level = level;
+
+		if (batch) {
+			fmt::print("--pack does not support --output-dir\n");
+			return -1;
+		}
+
+		if (!packRpl(options.get<std::string>("src"), options.get<std::string>("dst"), packOptions)) {
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (batch) {
+		std::vector<std::string> inputs;
+		auto paths = options.extra_arguments;
+
+		if (options.has("dst")) {
+			paths.insert(paths.begin(), options.get<std::string>("dst"));
+		}
+
+		if (options.has("src")) {
+			paths.insert(paths.begin(), options.get<std::string>("src"));
+		}
+
+		if (options.has("manifest") &&
+			 !readBatchManifest(inputs, options.get<std::string>("manifest"))) {
+			return -1;
+		}
+
+		for (auto &path : paths) {
+			if (!addBatchInput(inputs, path)) {
+				return -1;
+			}
+		}
+
+		// Files are converted in parallel, so each one uses a single thread
+		convertOptions.converter.jobs = 1;
+
+		if (!convertBatch(inputs, options.get<std::string>("output-dir"), convertOptions, jobs)) {
+			return -1;
+		}
+
+		return 0;
+	}
+
+	auto dst = options.get<std::string>("dst");
+
+#ifdef PLATFORM_POSIX
+	// The output takes over stdout, so the messages printed to stdout while
+	// converting are sent to stderr instead
+	if (dst == StandardStreamPath) {
+		std::fflush(stdout);
+		auto fd = dup(STDOUT_FILENO);
+		convertOptions.standardOutput = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+
+		if (!convertOptions.standardOutput || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			fmt::print(stderr, "Could not redirect stdout\n");
+			return -1;
+		}
+	}
+#endif
+
+	if (!convert(options.get<std::string>("src"), dst, convertOptions)) {
 		return -1;
 	}
 	
@@ -0,0 +1,427 @@
+#include "output_file.h"
+#include "utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fmt/format.h>
+
+#ifdef PLATFORM_POSIX
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Source of the zero bytes used to fill gaps between chunks
+static const char ZeroFill[4096] = { };
+
+// Sort the chunks into file order and check that none of them overlap
+static bool
+sortChunks(std::vector<OutputChunk> &chunks,
+           std::string &error)
+{
+   chunks.erase(std::remove_if(chunks.begin(), chunks.end(), [](const OutputChunk &chunk) {
+                   return chunk.size == 0;
+                }),
+                chunks.end());
+
+   std::stable_sort(chunks.begin(), chunks.end(), [](const OutputChunk &lhs, const OutputChunk &rhs) {
+      return lhs.offset < rhs.offset;
+   });
+
+   for (auto i = size_t { 1 }; i < chunks.size(); ++i) {
+      if (chunks[i - 1].offset + chunks[i - 1].size > chunks[i].offset) {
+         error = fmt::format("data at offset 0x{:X} overlaps data at offset 0x{:X}",
+                             chunks[i].offset, chunks[i - 1].offset);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+#ifdef PLATFORM_POSIX
+static bool
+writeVectors(int fd,
+             std::vector<iovec> &vectors,
+             size_t start,
+             std::string &error)
+{
+   auto offset = static_cast<off_t>(start);
+   auto first = size_t { 0 };
+
+   while (first < vectors.size()) {
+      auto count = static_cast<int>(std::min<size_t>(vectors.size() - first, IOV_MAX));
+      auto written = pwritev(fd, vectors.data() + first, count, offset);
+
+      if (written < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+
+         error = std::strerror(errno);
+         return false;
+      }
+
+      offset += written;
+
+      // Skip the vectors written completely and trim a partially written one
+      while (first < vectors.size() && static_cast<size_t>(written) >= vectors[first].iov_len) {
+         written -= vectors[first].iov_len;
+         ++first;
+      }
+
+      if (written) {
+         vectors[first].iov_base = reinterpret_cast<char *>(vectors[first].iov_base) + written;
+         vectors[first].iov_len -= written;
+      }
+   }
+
+   return true;
+}
+
+// Stream a generated chunk to its place in the file
+static bool
+writeGenerated(int fd,
+               const OutputChunk &chunk,
+               std::string &error)
+{
+   auto offset = chunk.offset;
+   auto end = chunk.offset + chunk.size;
+   auto writeError = std::string {};
+
+   auto writer = [&](const char *data, size_t size) {
+      if (size > end - offset) {
+         writeError = fmt::format("more than {} bytes were generated", chunk.size);
+         return false;
+      }
+
+      while (size) {
+         auto written = pwrite(fd, data, size, static_cast<off_t>(offset));
+
+         if (written < 0) {
+            if (errno == EINTR) {
+               continue;
+            }
+
+            writeError = std::strerror(errno);
+            return false;
+         }
+
+         data += written;
+         size -= static_cast<size_t>(written);
+         offset += static_cast<size_t>(written);
+      }
+
+      return true;
+   };
+
+   if (!chunk.produce(writer, error)) {
+      error = fmt::format("could not generate data at offset 0x{:X}: {}",
+                          chunk.offset, writeError.empty() ? error : writeError);
+      return false;
+   }
+
+   if (offset != end) {
+      error = fmt::format("only {} of {} bytes were generated at offset 0x{:X}",
+                          offset - chunk.offset, chunk.size, chunk.offset);
+      return false;
+   }
+
+   return true;
+}
+
+// Write the sorted chunks to a new, empty file
+static bool
+writeChunks(int fd,
+            const std::vector<OutputChunk> &chunks,
+            size_t fileSize,
+            std::string &error)
+{
+#ifdef PLATFORM_LINUX
+   // Only a hint, filesystems without fallocate just get the plain writes
+   if (fileSize) {
+      fallocate(fd, 0, 0, static_cast<off_t>(fileSize));
+   }
+#endif
+
+   // Runs of chunks in memory are gathered into one write, generated chunks
+   // split the runs and are streamed in between
+   std::vector<iovec> vectors;
+   auto position = size_t { 0 };
+   auto runStart = size_t { 0 };
+   auto result = true;
+   vectors.reserve(chunks.size() * 2);
+
+   for (auto &chunk : chunks) {
+      while (position < chunk.offset) {
+         auto size = std::min(chunk.offset - position, sizeof(ZeroFill));
+         vectors.push_back({ const_cast<char *>(ZeroFill), size });
+         position += size;
+      }
+
+      if (!chunk.produce) {
+         vectors.push_back({ const_cast<char *>(chunk.data), chunk.size });
+         position += chunk.size;
+         continue;
+      }
+
+      if (!writeVectors(fd, vectors, runStart, error) ||
+          !writeGenerated(fd, chunk, error)) {
+         result = false;
+         break;
+      }
+
+      vectors.clear();
+      position += chunk.size;
+      runStart = position;
+   }
+
+   return result && writeVectors(fd, vectors, runStart, error);
+}
+#endif
+
+bool
+writeOutputFile(const std::string &path,
+                std::vector<OutputChunk> chunks,
+                size_t fileSize,
+                std::string &error)
+{
+   if (!sortChunks(chunks, error)) {
+      return false;
+   }
+
+#ifdef PLATFORM_POSIX
+   // Written under a unique name next to path and renamed over it, so the
+   // input is still intact while it is read when path names the input too.
+   // Links are followed to the file they point at, anything which is not a
+   // regular file, such as /dev/null, is written in place.
+   auto target = path;
+   char resolved[PATH_MAX];
+   if (realpath(path.c_str(), resolved)) {
+      target = resolved;
+   }
+
+   struct stat st;
+   auto inPlace = stat(target.c_str(), &st) == 0 && !S_ISREG(st.st_mode);
+   auto temp = target + ".XXXXXX";
+   auto fd = inPlace ? open(target.c_str(), O_WRONLY) : mkstemp(&temp[0]);
+   if (fd < 0) {
+      error = fmt::format("could not open {} for writing: {}", path, std::strerror(errno));
+      return false;
+   }
+
+   // mkstemp creates 0600 files, give the output the mode open would have
+   if (!inPlace) {
+      fchmod(fd, 0644);
+   }
+
+   auto result = writeChunks(fd, chunks, fileSize, error);
+
+   if (close(fd) != 0 && result) {
+      error = std::strerror(errno);
+      result = false;
+   }
+
+   if (!inPlace && result && rename(temp.c_str(), target.c_str()) != 0) {
+      error = fmt::format("could not rename {} to {}: {}", temp, target, std::strerror(errno));
+      result = false;
+   }
+
+   // Do not leave a partially written file behind
+   if (!inPlace && !result) {
+      unlink(temp.c_str());
+   }
+
+   return result;
+#else
+   (void)fileSize;
+
+   // Renamed over path once complete, like on POSIX, so the input is
+   // still intact while it is read when path names the input too
+   auto temp = path + ".tmp";
+   std::ofstream out { temp, std::ofstream::binary };
+   if (!out.is_open()) {
+      error = fmt::format("could not open {} for writing", temp);
+      return false;
+   }
+
+   for (auto &chunk : chunks) {
+      out.seekp(chunk.offset, std::ios::beg);
+
+      if (!chunk.produce) {
+         out.write(chunk.data, chunk.size);
+         continue;
+      }
+
+      auto written = size_t { 0 };
+      auto writer = [&](const char *data, size_t size) {
+         written += size;
+         out.write(data, size);
+         return written <= chunk.size && !!out;
+      };
+
+      if (!chunk.produce(writer, error) || written != chunk.size) {
+         error = fmt::format("could not generate data at offset 0x{:X}: {}", chunk.offset, error);
+         out.close();
+         std::remove(temp.c_str());
+         return false;
+      }
+   }
+
+   out.close();
+   if (!out) {
+      error = "write failed";
+      std::remove(temp.c_str());
+      return false;
+   }
+
+   // rename does not replace an existing file here
+   std::remove(path.c_str());
+   if (std::rename(temp.c_str(), path.c_str()) != 0) {
+      error = fmt::format("could not rename {} to {}", temp, path);
+      std::remove(temp.c_str());
+      return false;
+   }
+
+   return true;
+#endif
+}
+
+bool
+writeOutputBuffer(std::vector<OutputChunk> chunks,
+                  size_t fileSize,
+                  std::vector<char> &output,
+                  std::string &error)
+{
+   if (!sortChunks(chunks, error)) {
+      return false;
+   }
+
+   if (!chunks.empty()) {
+      fileSize = std::max(fileSize, chunks.back().offset + chunks.back().size);
+   }
+
+   output.assign(fileSize, 0);
+
+   for (auto &chunk : chunks) {
+      if (!chunk.produce) {
+         std::memcpy(output.data() + chunk.offset, chunk.data, chunk.size);
+         continue;
+      }
+
+      auto offset = chunk.offset;
+      auto end = chunk.offset + chunk.size;
+      auto writeError = std::string {};
+      auto writer = [&](const char *data, size_t size) {
+         if (size > end - offset) {
+            writeError = fmt::format("more than {} bytes were generated", chunk.size);
+            return false;
+         }
+
+         std::memcpy(output.data() + offset, data, size);
+         offset += size;
+         return true;
+      };
+
+      if (!chunk.produce(writer, error)) {
+         error = fmt::format("could not generate data at offset 0x{:X}: {}",
+                             chunk.offset, writeError.empty() ? error : writeError);
+         return false;
+      }
+
+      if (offset != end) {
+         error = fmt::format("only {} of {} bytes were generated at offset 0x{:X}",
+                             offset - chunk.offset, chunk.size, chunk.offset);
+         return false;
+      }
+   }
+
+   return true;
+}
+
+bool
+writeOutputStream(std::FILE *stream,
+                  std::vector<OutputChunk> chunks,
+                  size_t fileSize,
+                  std::string &error)
+{
+   if (!sortChunks(chunks, error)) {
+      return false;
+   }
+
+   auto position = size_t { 0 };
+   auto writeError = std::string {};
+   auto write = [&](const char *data, size_t size) {
+      if (std::fwrite(data, 1, size, stream) != size) {
+         writeError = std::strerror(errno);
+         return false;
+      }
+
+      position += size;
+      return true;
+   };
+
+   auto fill = [&](size_t end) {
+      while (position < end) {
+         if (!write(ZeroFill, std::min(end - position, sizeof(ZeroFill)))) {
+            return false;
+         }
+      }
+
+      return true;
+   };
+
+   for (auto &chunk : chunks) {
+      if (!fill(chunk.offset)) {
+         error = writeError;
+         return false;
+      }
+
+      if (!chunk.produce) {
+         if (!write(chunk.data, chunk.size)) {
+            error = writeError;
+            return false;
+         }
+
+         continue;
+      }
+
+      auto end = chunk.offset + chunk.size;
+      auto writer = [&](const char *data, size_t size) {
+         if (size > end - position) {
+            writeError = fmt::format("more than {} bytes were generated", chunk.size);
+            return false;
+         }
+
+         return write(data, size);
+      };
+
+      if (!chunk.produce(writer, error)) {
+         error = fmt::format("could not generate data at offset 0x{:X}: {}",
+                             chunk.offset, writeError.empty() ? error : writeError);
+         return false;
+      }
+
+      if (position != end) {
+         error = fmt::format("only {} of {} bytes were generated at offset 0x{:X}",
+                             position - chunk.offset, chunk.size, chunk.offset);
+         return false;
+      }
+   }
+
+   if (!fill(fileSize) || std::fflush(stream) != 0) {
+      error = writeError.empty() ? std::strerror(errno) : writeError;
+      return false;
+   }
+
+   return true;
+}
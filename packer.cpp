@@ -0,0 +1,222 @@
+#include "compressor.h"
+#include "crc.h"
+#include "packer.h"
+#include "parallel.h"
+#include "rpl2elf.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstring>
+#include <fmt/format.h>
+
+// Sections smaller than this are stored uncompressed, as by the official tools
+static const uint32_t MinDeflatedSectionSize = 0x18;
+
+static Section *
+findSection(Rpl &rpl,
+            uint32_t type)
+{
+   for (auto &section : rpl.sections) {
+      if (section.header.type == type) {
+         return &section;
+      }
+   }
+
+   return nullptr;
+}
+
+static bool
+isSectionDeflated(const Section &section)
+{
+   switch (section.header.type) {
+   case elf::SHT_NULL:
+   case elf::SHT_NOBITS:
+   case elf::SHT_RPL_CRCS:
+   case elf::SHT_RPL_FILEINFO:
+      return false;
+   default:
+      return section.size() >= MinDeflatedSectionSize;
+   }
+}
+
+// Loader regions the fileinfo sizes are measured in, as laid out by the
+// official tools
+static const uint32_t CodeBaseAddress = 0x02000000;
+static const uint32_t DataBaseAddress = 0x10000000;
+static const uint32_t LoadBaseAddress = 0xC0000000;
+
+// Recompute the region sizes and alignments of the fileinfo from the section
+// headers the way the official tools do, so sections which grew since the
+// conversion are allocated for by the loader. Alignments never go below the
+// ones the official tools write.
+static void
+updateFileInfo(Rpl &rpl,
+               elf::RplFileInfo &info)
+{
+   auto textSize = 0u, dataSize = 0u, loadSize = 0u, tempSize = 0u;
+   auto textAlign = 32u, dataAlign = 4096u, loadAlign = 4u;
+   auto relocatedSize = 0u;
+
+   for (auto &section : rpl.sections) {
+      uint32_t addr = section.header.addr;
+      uint32_t size = section.header.size;
+      uint32_t align = std::max(1u, static_cast<uint32_t>(section.header.addralign));
+
+      if (section.header.type != elf::SHT_NOBITS) {
+         size = static_cast<uint32_t>(section.size());
+      }
+
+      if (addr >= LoadBaseAddress) {
+         loadSize = std::max(loadSize, addr + size - LoadBaseAddress);
+         loadAlign = std::max(loadAlign, align);
+      } else if (addr >= DataBaseAddress) {
+         dataSize = std::max(dataSize, addr + size - DataBaseAddress);
+         dataAlign = std::max(dataAlign, align);
+      } else if (addr >= CodeBaseAddress) {
+         textSize = std::max(textSize, addr + size - CodeBaseAddress);
+         textAlign = std::max(textAlign, align);
+      } else if (addr) {
+         // Import sections relocateImports moved out of the loader region
+         relocatedSize = align_up(relocatedSize, align) + size;
+         loadAlign = std::max(loadAlign, align);
+      } else if (section.header.type != elf::SHT_NULL &&
+                 section.header.type != elf::SHT_RPL_CRCS &&
+                 section.header.type != elf::SHT_RPL_FILEINFO) {
+         tempSize += size + 128;
+      }
+   }
+
+   info.textSize = textSize;
+   info.textAlign = textAlign;
+   info.dataSize = dataSize;
+   info.dataAlign = dataAlign;
+   info.loadSize = align_up(loadSize, loadAlign) + relocatedSize;
+   info.loadAlign = loadAlign;
+   info.tempSize = tempSize;
+}
+
+// Store the CRC-32 of the uncompressed contents of every section in the
+// CRCs section, whose own entry is 0
+static bool
+calculateCrcs(Rpl &rpl,
+              unsigned jobs)
+{
+   auto crcs = findSection(rpl, elf::SHT_RPL_CRCS);
+   auto &data = crcs->mutableData();
+
+   if (data.size() != rpl.sections.size() * sizeof(elf::RplCrc)) {
+      fmt::print("CRCs section has {} bytes for {} sections\n", data.size(), rpl.sections.size());
+      return false;
+   }
+
+   auto entries = reinterpret_cast<elf::RplCrc *>(data.data());
+   parallel_for(rpl.sections.size(), jobs, [&](size_t i, unsigned) {
+      auto &section = rpl.sections[i];
+      auto crc = 0u;
+
+      if (&section != crcs && section.header.type != elf::SHT_NOBITS && section.size()) {
+         crc = updateCrc32(0, section.bytes(), section.size());
+      }
+
+      entries[i].crc = crc;
+   });
+
+   return true;
+}
+
+// Replace the contents of every section the loader inflates with their size
+// and zlib stream, all of them are compressed together with up to jobs threads
+static bool
+compressSections(Rpl &rpl,
+                 int level,
+                 unsigned jobs)
+{
+   std::vector<uint32_t> indices;
+   std::vector<CompressorInput> inputs;
+
+   for (auto i = 0u; i < rpl.sections.size(); ++i) {
+      auto &section = rpl.sections[i];
+      auto flags = static_cast<uint32_t>(section.header.flags);
+
+      if (isSectionDeflated(section)) {
+         indices.push_back(i);
+         inputs.push_back({ section.bytes(), section.size() });
+         section.header.flags = flags | elf::SHF_DEFLATED;
+      } else {
+         section.header.flags = flags & ~elf::SHF_DEFLATED;
+      }
+   }
+
+   auto error = std::string {};
+   std::vector<std::vector<char>> outputs;
+
+   if (!compressBuffers(inputs, outputs, CompressorType::Zlib, level, jobs, error)) {
+      fmt::print("Couldn't compress .rpx sections because {}\n", error);
+      return false;
+   }
+
+   for (auto i = size_t { 0 }; i < indices.size(); ++i) {
+      auto &section = rpl.sections[indices[i]];
+      auto size = byte_swap(static_cast<uint32_t>(inputs[i].size));
+
+      section.clearData();
+      section.data.resize(sizeof(uint32_t) + outputs[i].size());
+      std::memcpy(section.data.data(), &size, sizeof(uint32_t));
+      std::memcpy(section.data.data() + sizeof(uint32_t), outputs[i].data(), outputs[i].size());
+      std::vector<char>().swap(outputs[i]);
+   }
+
+   return true;
+}
+
+bool
+packRpl(const std::string &src,
+        const std::string &dst,
+        const PackOptions &options)
+{
+   Rpl rpl;
+
+   if (!readElf(rpl, src, options.map)) {
+      return false;
+   }
+
+   auto fileInfo = findSection(rpl, elf::SHT_RPL_FILEINFO);
+
+   if (!findSection(rpl, elf::SHT_RPL_CRCS) || !fileInfo) {
+      fmt::print("{} has no CRCs or fileinfo section, it was not converted from an .rpl\n", src);
+      return false;
+   }
+
+   if (fileInfo->size() < sizeof(elf::RplFileInfo)) {
+      fmt::print("Fileinfo section is too small\n");
+      return false;
+   }
+
+   // The loader only knows SHF_DEFLATED, a SHF_COMPRESSED body would be
+   // deflated a second time behind its Elf32_Chdr
+   for (auto &section : rpl.sections) {
+      if (section.header.flags & elf::SHF_COMPRESSED) {
+         fmt::print("Section {} is SHF_COMPRESSED, convert without --compress-sections to pack it\n", section.name);
+         return false;
+      }
+   }
+
+   rpl.header.abi = elf::EABI_CAFE;
+   rpl.header.type = uint16_t { elf::ET_CAFE_RPL };
+
+   // Program headers from --program-headers are not written back
+   rpl.header.phoff = uint32_t { 0 };
+   rpl.header.phnum = uint16_t { 0 };
+   rpl.header.phentsize = uint16_t { 0 };
+
+   auto info = reinterpret_cast<elf::RplFileInfo *>(fileInfo->mutableData().data());
+   info->compressionLevel = options.level;
+   updateFileInfo(rpl, *info);
+
+   if (!calculateCrcs(rpl, options.jobs) ||
+       !compressSections(rpl, options.level, options.jobs) ||
+       !calculateSectionOffsets(rpl)) {
+      return false;
+   }
+
+   return writeElf(rpl, dst);
+}
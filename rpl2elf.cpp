@@ -0,0 +1,1963 @@
+#include "crc.h"
+#include "decompressor.h"
+#include "elf.h"
+#include "output_file.h"
+#include "parallel.h"
+#include "rpl2elf.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fmt/format.h>
+#include <tuple>
+#include <vector>
+
+uint32_t
+getSectionIndex(const Rpl &rpl,
+					 const Section &section)
+{
+	return static_cast<uint32_t>(&section - &rpl.sections[0]);
+}
+
+
+/**
+ * Returns true if the section has a body stored in the file.
+ */
+static bool
+hasSectionData(const Section &section)
+{
+	return section.header.type != elf::SHT_NOBITS && section.header.size;
+}
+
+/**
+ * Returns true for sections whose contents the later stages read or rewrite,
+ * the others are only copied through to the output.
+ */
+static bool
+isSectionInflatedOnRead(const Rpl &rpl,
+								uint32_t index)
+{
+	switch (rpl.sections[index].header.type) {
+	case elf::SHT_RELA:
+	case elf::SHT_SYMTAB:
+	case elf::SHT_RPL_IMPORTS:
+		return true;
+	default:
+		return index == rpl.header.shstrndx;
+	}
+}
+
+/**
+ * Locate the zlib stream of a SHF_DEFLATED section and read its inflated size.
+ */
+static bool
+readCompressedSection(InputFile &input,
+							 Section &section)
+{
+	// Read the original size
+	uint32_t size = 0;
+	if (section.header.size < sizeof(uint32_t) ||
+		 !input.read(section.header.offset, &size, sizeof(uint32_t))) {
+		fmt::print("Couldn't read .rpx section inflated size\n");
+		return false;
+	}
+
+	section.compressed = true;
+	section.compressedOffset = section.header.offset + sizeof(uint32_t);
+	section.compressedSize = section.header.size - sizeof(uint32_t);
+	section.inflatedSize = byte_swap(size);
+	return true;
+}
+
+/**
+ * Inflate a SHF_DEFLATED section located by readCompressedSection.
+ */
+static bool
+inflateSection(InputFile &input,
+					Section &section,
+					Decompressor &decompressor)
+{
+	section.data.resize(section.inflatedSize);
+
+	// Inflate
+	auto error = std::string {};
+	if (!decompressor.decompress(input,
+										  section.compressedOffset,
+										  section.compressedSize,
+										  section.data.data(),
+										  section.data.size(),
+										  error)) {
+		fmt::print("Couldn't decompress .rpx section because {}\n", error);
+		section.data.clear();
+		return false;
+	}
+
+	section.compressed = false;
+	return true;
+}
+
+// Size of the pieces deferred sections are read in
+static const size_t DeferredReadSize = 256 * 1024;
+
+/**
+ * Pass the contents of a deferred section to sink a piece at a time.
+ */
+static bool
+readDeferredSection(InputFile &input,
+						  const Section &section,
+						  const Decompressor::Sink &sink,
+						  std::string &error)
+{
+	std::vector<char> buffer(std::min(section.deferredSize, DeferredReadSize));
+
+	for (auto offset = size_t { 0 }; offset < section.deferredSize; offset += buffer.size()) {
+		auto size = std::min(section.deferredSize - offset, buffer.size());
+
+		if (!input.read(section.deferredOffset + offset, buffer.data(), size)) {
+			error = "could not read the input";
+			return false;
+		}
+
+		if (!sink(buffer.data(), size)) {
+			error = "could not write the contents";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Read the contents of a section whose header has already been read,
+ * deflated sections are only inflated when inflate is set. Uncompressed
+ * sections are left in an unmapped input when defer is set. With deflated
+ * unset SHF_DEFLATED is ignored and every section is read as stored.
+ *
+ * Called concurrently for different sections.
+ */
+static bool
+readSection(InputFile &input,
+				Section &section,
+				Decompressor &decompressor,
+				bool deflated,
+				bool inflate,
+				bool defer)
+{
+	if (!input.contains(section.header.offset, section.header.size)) {
+		fmt::print("Section data is outside of the file\n");
+		return false;
+	}
+
+	// Read section data
+	if (deflated && (section.header.flags & elf::SHF_DEFLATED)) {
+		if (!readCompressedSection(input, section) ||
+			 (inflate && !inflateSection(input, section, decompressor))) {
+			return false;
+		}
+	} else if (input.mapped()) {
+		// Uncompressed sections refer directly to the mapped input
+		section.view = input.view(section.header.offset, section.header.size);
+		section.viewSize = section.header.size;
+	} else if (defer) {
+		section.deferred = true;
+		section.deferredOffset = section.header.offset;
+		section.deferredSize = section.header.size;
+	} else {
+		section.data.resize(section.header.size);
+		input.read(section.header.offset, section.data.data(), section.header.size);
+	}
+
+	return true;
+}
+
+/**
+ * Read the .rpl file opened in rpl.input, deflated is unset for an .elf
+ */
+static bool
+readRplInput(Rpl &rpl,
+				 DecompressorType decompressorType,
+				 unsigned jobs,
+				 bool deflated)
+{
+	if (!rpl.input.read(0, &rpl.header, sizeof(elf::Header))) {
+		fmt::print("File is too small to be an ELF\n");
+		return false;
+	}
+
+	if (rpl.header.magic != elf::HeaderMagic) {
+		fmt::print("Invalid ELF magic header\n");
+		return false;
+	}
+
+	rpl.fileSize = static_cast<uint32_t>(rpl.input.size());
+
+	// Every later inflate creates the same engine, checking it once here is
+	// enough
+	auto decompressor = createDecompressor(decompressorType);
+	if (!decompressor) {
+		fmt::print("decompressor {} is not available in this build\n", getDecompressorName(decompressorType));
+		return false;
+	}
+
+	// Read section headers
+	rpl.sections.reserve(rpl.header.shnum);
+
+	for (auto i = 0u; i < rpl.header.shnum; ++i) {
+		auto &section = rpl.sections.emplace_back();
+
+		if (!rpl.input.read(rpl.header.shoff + rpl.header.shentsize * i,
+								  &section.header, sizeof(elf::SectionHeader))) {
+			fmt::print("Section header {} is outside of the file\n", i);
+			return false;
+		}
+	}
+
+	if (rpl.header.shstrndx >= rpl.sections.size()) {
+		fmt::print("Section name table {} is not one of the {} sections\n",
+					  static_cast<uint16_t>(rpl.header.shstrndx), rpl.sections.size());
+		return false;
+	}
+
+	// Read section data, sections are independent so inflate them in
+	// parallel, largest first so the biggest section does not start last.
+	std::vector<uint32_t> pending;
+	for (auto i = 0u; i < rpl.sections.size(); ++i) {
+		if (hasSectionData(rpl.sections[i])) {
+			pending.push_back(i);
+		}
+	}
+
+	std::sort(pending.begin(), pending.end(), [&](uint32_t lhs, uint32_t rhs) {
+		return rpl.sections[lhs].header.size > rpl.sections[rhs].header.size;
+	});
+
+	// Under a memory budget everything but the sections the later stages
+	// rewrite stays in the input, those have to fit in the budget
+	auto budget = deflated ? rpl.memoryBudget : 0;
+
+	if (budget) {
+		// An engine which cannot stream inflates each lazily written section
+		// whole, one at a time
+		auto streams = isStreamingDecompressor(decompressorType);
+		auto resident = size_t { 0 };
+		auto largestLazy = size_t { 0 };
+
+		for (auto index : pending) {
+			auto &section = rpl.sections[index];
+			auto size = static_cast<size_t>(section.header.size);
+			auto needed = isSectionInflatedOnRead(rpl, index);
+
+			if (!needed && streams) {
+				continue;
+			}
+
+			if (section.header.flags & elf::SHF_DEFLATED) {
+				uint32_t inflatedSize = 0;
+
+				if (!rpl.input.read(section.header.offset, &inflatedSize, sizeof(uint32_t))) {
+					fmt::print("Couldn't read .rpx section inflated size\n");
+					return false;
+				}
+
+				size = byte_swap(inflatedSize);
+			} else if (!needed) {
+				continue;
+			}
+
+			if (needed) {
+				resident += size;
+			} else {
+				largestLazy = std::max(largestLazy, size);
+			}
+		}
+
+		if (resident > budget) {
+			fmt::print("Relocation, symbol and import sections need {} bytes, over the memory budget of {} bytes\n",
+						  resident, budget);
+			return false;
+		}
+
+		if (resident + largestLazy > budget) {
+			fmt::print("The inflate engine does not stream, the largest section needs {} bytes on top of {} bytes of tables, over the memory budget of {} bytes\n",
+						  largestLazy, resident, budget);
+			return false;
+		}
+	}
+
+	// Each worker keeps one decompressor for all the sections it inflates
+	std::vector<std::unique_ptr<Decompressor>> decompressors(std::max(1u, jobs));
+	decompressors[0] = std::move(decompressor);
+	std::vector<char> failed(rpl.sections.size(), 0);
+	parallel_for(pending.size(), jobs, [&](size_t i, unsigned worker) {
+		auto index = pending[i];
+		auto &decompressor = decompressors[worker];
+
+		if (!decompressor) {
+			decompressor = createDecompressor(decompressorType);
+		}
+
+		auto needed = isSectionInflatedOnRead(rpl, index);
+		failed[index] = !readSection(rpl.input, rpl.sections[index], *decompressor, deflated,
+											  needed, budget && !needed);
+	});
+
+	// Kept for the sections inflated later
+	rpl.decompressorType = decompressorType;
+	rpl.decompressor = std::move(decompressors[0]);
+
+	for (auto i = 0u; i < rpl.sections.size(); ++i) {
+		if (failed[i]) {
+			fmt::print("Error reading section {}\n", i);
+			return false;
+		}
+	}
+
+	rpl.stats.bytesRead = sizeof(elf::Header) + rpl.sections.size() * sizeof(elf::SectionHeader);
+	for (auto index : pending) {
+		auto &section = rpl.sections[index];
+		rpl.stats.bytesRead += section.header.size;
+
+		if (deflated && (section.header.flags & elf::SHF_DEFLATED)) {
+			rpl.stats.bytesInflated += section.size();
+		}
+	}
+
+	// Set section names, each must be NUL terminated inside the table
+	auto &shStrTab = rpl.sections[rpl.header.shstrndx];
+	auto strings = shStrTab.bytes();
+	auto stringsSize = shStrTab.size();
+
+	for (auto i = 0u; i < rpl.sections.size(); ++i) {
+		auto &section = rpl.sections[i];
+		auto name = static_cast<size_t>(section.header.name);
+		auto end = name < stringsSize ? std::memchr(strings + name, 0, stringsSize - name) : nullptr;
+
+		if (!end) {
+			fmt::print("Section {} name {} is outside of the section name table\n", i, name);
+			return false;
+		}
+
+		section.name.assign(strings + name, static_cast<const char *>(end));
+	}
+
+	return true;
+}
+
+/**
+ * Read the .rpl file
+ */
+bool
+readRpl(Rpl &rpl,
+		  const std::string &path,
+		  bool map,
+		  DecompressorType decompressorType,
+		  unsigned jobs)
+{
+	// Read file
+	if (!rpl.input.open(path, map)) {
+		fmt::print("Could not open {} for reading\n", path);
+		return false;
+	}
+
+	return readRplInput(rpl, decompressorType, jobs, true);
+}
+
+/**
+ * Read an .rpl file from memory, data is used in place and must outlive rpl.
+ */
+bool
+readRpl(Rpl &rpl,
+		  const void *data,
+		  size_t size,
+		  DecompressorType decompressorType,
+		  unsigned jobs)
+{
+	rpl.input.openMemory(data, size);
+	return readRplInput(rpl, decompressorType, jobs, true);
+}
+
+/**
+ * Read an .elf file, section contents are taken as stored.
+ */
+bool
+readElf(Rpl &rpl,
+		  const std::string &path,
+		  bool map)
+{
+	if (!rpl.input.open(path, map)) {
+		fmt::print("Could not open {} for reading\n", path);
+		return false;
+	}
+
+	return readRplInput(rpl, DecompressorType::Zlib, 1, false);
+}
+
+/**
+ * Load a section readRpl left compressed or deferred.
+ */
+bool
+loadSection(Rpl &rpl,
+				Section &section)
+{
+	if (section.deferred) {
+		section.data.resize(section.deferredSize);
+
+		if (!rpl.input.read(section.deferredOffset, section.data.data(), section.data.size())) {
+			fmt::print("Couldn't read section {}\n", section.name);
+			section.data.clear();
+			return false;
+		}
+
+		section.deferred = false;
+		return true;
+	}
+
+	if (!section.compressed) {
+		return true;
+	}
+
+	if (!rpl.decompressor) {
+		rpl.decompressor = createDecompressor(rpl.decompressorType);
+	}
+
+	return inflateSection(rpl.input, section, *rpl.decompressor);
+}
+
+/**
+ * Check the contents of every section against the SHT_RPL_CRCS table.
+ *
+ * Sections left compressed by readRpl are inflated into the CRC and
+ * discarded, so this costs a second inflate of them but no memory.
+ */
+bool
+verifyCrcs(Rpl &file,
+			  unsigned jobs)
+{
+	auto crcs = std::find_if(file.sections.begin(), file.sections.end(), [](const Section &section) {
+		return section.header.type == elf::SHT_RPL_CRCS;
+	});
+
+	if (crcs == file.sections.end()) {
+		fmt::print("No SHT_RPL_CRCS section to verify against\n");
+		return false;
+	}
+
+	if (!loadSection(file, *crcs)) {
+		return false;
+	}
+
+	// Sections without contents and the CRC table itself have no CRC
+	auto numCrcs = std::min(crcs->size() / sizeof(elf::RplCrc), file.sections.size());
+	auto table = reinterpret_cast<const elf::RplCrc *>(crcs->bytes());
+	std::vector<uint32_t> pending;
+
+	for (auto i = 0u; i < numCrcs; ++i) {
+		if (hasSectionData(file.sections[i]) && &file.sections[i] != &*crcs) {
+			pending.push_back(i);
+		}
+	}
+
+	if (numCrcs < file.sections.size()) {
+		fmt::print("SHT_RPL_CRCS only has {} of {} sections\n", numCrcs, file.sections.size());
+	}
+
+	std::sort(pending.begin(), pending.end(), [&](uint32_t lhs, uint32_t rhs) {
+		return file.sections[lhs].size() > file.sections[rhs].size();
+	});
+
+	// readRpl only allowed for one section inflated whole at a time
+	if (file.memoryBudget && !isStreamingDecompressor(file.decompressorType)) {
+		jobs = 1;
+	}
+
+	std::vector<std::unique_ptr<Decompressor>> decompressors(std::max(1u, jobs));
+	std::vector<uint32_t> computed(file.sections.size(), 0);
+	std::vector<std::string> errors(file.sections.size());
+	parallel_for(pending.size(), jobs, [&](size_t i, unsigned worker) {
+		auto index = pending[i];
+		auto &section = file.sections[index];
+
+		auto crc = 0u;
+		auto update = [&](const char *data, size_t size) {
+			crc = updateCrc32(crc, data, size);
+			return true;
+		};
+
+		if (section.deferred) {
+			readDeferredSection(file.input, section, update, errors[index]);
+			computed[index] = crc;
+			return;
+		}
+
+		if (!section.compressed) {
+			computed[index] = updateCrc32(0, section.bytes(), section.size());
+			return;
+		}
+
+		auto &decompressor = decompressors[worker];
+		if (!decompressor) {
+			decompressor = createDecompressor(file.decompressorType);
+		}
+
+		decompressor->decompressStream(file.input,
+												 section.compressedOffset,
+												 section.compressedSize,
+												 section.inflatedSize,
+												 update,
+												 errors[index]);
+		computed[index] = crc;
+	});
+
+	auto result = numCrcs == file.sections.size();
+	std::sort(pending.begin(), pending.end());
+
+	for (auto index : pending) {
+		auto &section = file.sections[index];
+
+		if (!errors[index].empty()) {
+			fmt::print("Couldn't read section {} {} because {}\n", index, section.name, errors[index]);
+			result = false;
+		} else if (computed[index] != table[index].crc) {
+			fmt::print("Section {} {} CRC mismatch: stored {:08X}, computed {:08X}\n",
+						  index, section.name, static_cast<uint32_t>(table[index].crc), computed[index]);
+			result = false;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Fix file header to look like an ELF file!
+ */
+bool
+fixFileHeader(Rpl &file)
+{
+	file.header.abi = elf::EABI_NONE;
+	file.header.type = uint16_t { elf::ET_EXEC };
+	return true;
+}
+
+// Number of table entries byte swapped at a time by decode/encodeTables
+static const size_t TableChunkSize = 256;
+
+/**
+ * Decode the SHT_RELA and SHT_SYMTAB sections into native endian tables.
+ *
+ * The passes that rewrite relocations and symbols work on these tables,
+ * encodeTables turns them back into big endian section data.
+ */
+bool
+decodeTables(Rpl &file)
+{
+	for (auto &section : file.sections) {
+		if (section.header.type == elf::SHT_RELA) {
+			auto count = section.size() / sizeof(elf::Rela);
+			auto rels = reinterpret_cast<const elf::Rela *>(section.bytes());
+			elf::NativeRela chunk[TableChunkSize];
+
+			auto &table = section.relocations;
+			table.resize(count);
+
+			for (auto base = size_t { 0 }; base < count; base += TableChunkSize) {
+				auto chunkSize = std::min(TableChunkSize, count - base);
+				byte_swap_words(chunk, rels + base, chunkSize * elf::RelaWords);
+
+				for (auto i = size_t { 0 }; i < chunkSize; ++i) {
+					table.offset[base + i] = chunk[i].offset;
+					table.symbol[base + i] = chunk[i].info >> 8;
+					table.type[base + i] = static_cast<uint8_t>(chunk[i].info & 0xFF);
+					table.addend[base + i] = chunk[i].addend;
+				}
+			}
+
+			section.clearData();
+		} else if (section.header.type == elf::SHT_SYMTAB) {
+			auto count = section.size() / sizeof(elf::Symbol);
+			auto symbols = reinterpret_cast<const elf::Symbol *>(section.bytes());
+			elf::NativeSymbol chunk[TableChunkSize];
+
+			auto &table = section.symbols;
+			table.resize(count);
+
+			for (auto base = size_t { 0 }; base < count; base += TableChunkSize) {
+				auto chunkSize = std::min(TableChunkSize, count - base);
+				byte_swap_words(chunk, symbols + base, chunkSize * elf::SymbolWords);
+
+				for (auto i = size_t { 0 }; i < chunkSize; ++i) {
+					table.name[base + i] = chunk[i].name;
+					table.value[base + i] = chunk[i].value;
+					table.size[base + i] = chunk[i].size;
+					table.info[base + i] = chunk[i].info;
+					table.other[base + i] = chunk[i].other;
+					table.shndx[base + i] = chunk[i].shndx;
+				}
+			}
+
+			section.clearData();
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Encode the tables decoded by decodeTables back into section data.
+ */
+bool
+encodeTables(Rpl &file)
+{
+	for (auto &section : file.sections) {
+		if (section.header.type == elf::SHT_RELA) {
+			auto &table = section.relocations;
+			auto count = table.count();
+			elf::NativeRela chunk[TableChunkSize];
+
+			section.data.resize(count * sizeof(elf::Rela));
+			auto rels = reinterpret_cast<elf::Rela *>(section.data.data());
+
+			for (auto base = size_t { 0 }; base < count; base += TableChunkSize) {
+				auto chunkSize = std::min(TableChunkSize, count - base);
+
+				for (auto i = size_t { 0 }; i < chunkSize; ++i) {
+					chunk[i].offset = table.offset[base + i];
+					chunk[i].info = (table.symbol[base + i] << 8) | table.type[base + i];
+					chunk[i].addend = table.addend[base + i];
+				}
+
+				byte_swap_words(rels + base, chunk, chunkSize * elf::RelaWords);
+			}
+
+			section.relocations = RelocationTable {};
+		} else if (section.header.type == elf::SHT_SYMTAB) {
+			auto &table = section.symbols;
+			auto count = table.count();
+			elf::NativeSymbol chunk[TableChunkSize];
+
+			section.data.resize(count * sizeof(elf::Symbol));
+			auto symbols = reinterpret_cast<elf::Symbol *>(section.data.data());
+
+			for (auto base = size_t { 0 }; base < count; base += TableChunkSize) {
+				auto chunkSize = std::min(TableChunkSize, count - base);
+
+				for (auto i = size_t { 0 }; i < chunkSize; ++i) {
+					chunk[i].name = table.name[base + i];
+					chunk[i].value = table.value[base + i];
+					chunk[i].size = table.size[base + i];
+					chunk[i].info = table.info[base + i];
+					chunk[i].other = table.other[base + i];
+					chunk[i].shndx = table.shndx[base + i];
+				}
+
+				byte_swap_words(symbols + base, chunk, chunkSize * elf::SymbolWords);
+			}
+
+			section.symbols = SymbolTable {};
+		}
+	}
+
+	return true;
+}
+
+/**
+ * A R_PPC_GHS_REL16_HI or _LO relocation, ordered by the fields used to
+ * pair the two halves up.
+ */
+struct GhsRelocation
+{
+	uint32_t info;
+	uint32_t offset;
+	int32_t addend;
+	uint32_t index;
+
+	bool operator <(const GhsRelocation &other) const
+	{
+		return std::tie(info, offset, addend, index) <
+				 std::tie(other.info, other.offset, other.addend, other.index);
+	}
+};
+
+/**
+ * Consume every unconsumed GHS_REL16 half matching symbol, type, offset
+ * and addend. Returns the number of halves consumed, each of which pairs
+ * up into one R_PPC_REL32.
+ */
+static uint32_t
+consumeGhsRel16(const std::vector<GhsRelocation> &ghsRelocations,
+					 std::vector<char> &consumed,
+					 uint32_t symbol,
+					 uint8_t type,
+					 uint32_t offset,
+					 int32_t addend)
+{
+	auto info = (symbol << 8) | type;
+	auto key = GhsRelocation { info, offset, addend, 0 };
+	auto count = 0u;
+
+	for (auto itr = std::lower_bound(ghsRelocations.begin(), ghsRelocations.end(), key);
+		  itr != ghsRelocations.end() && itr->info == info && itr->offset == offset && itr->addend == addend;
+		  ++itr) {
+		if (!consumed[itr->index]) {
+			consumed[itr->index] = 1;
+			++count;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Fix relocations.
+ * Replace non-standard GHS_REL16 relocations
+ */
+bool
+fixRelocations(Rpl &file)
+{
+	for (auto &section : file.sections) {
+		if (section.header.type != elf::SHT_RELA) {
+			continue;
+		}
+
+		// Clear flags
+		section.header.flags = 0u;
+
+		auto &rels = section.relocations;
+		auto numRels = static_cast<uint32_t>(rels.count());
+
+		// Index the GHS_REL16 halves so their partners can be looked up
+		// instead of rescanning the whole table for every half.
+		std::vector<GhsRelocation> ghsRelocations;
+		std::vector<char> consumed(numRels, 0);
+		auto unmatched = 0u;
+		auto duplicates = false;
+
+		for (auto i = 0u; i < numRels; ++i) {
+			auto type = rels.type[i];
+
+			if (type == elf::R_PPC_GHS_REL16_HI || type == elf::R_PPC_GHS_REL16_LO) {
+				ghsRelocations.push_back({ (rels.symbol[i] << 8) | type, rels.offset[i], rels.addend[i], i });
+			}
+		}
+
+		std::sort(ghsRelocations.begin(), ghsRelocations.end());
+
+		for (auto i = 1u; i < ghsRelocations.size(); ++i) {
+			auto &prev = ghsRelocations[i - 1];
+			auto &next = ghsRelocations[i];
+			duplicates |= (prev.info == next.info && prev.offset == next.offset && prev.addend == next.addend);
+		}
+
+		// The table is compacted in place, relocations are written back at
+		// or before the one being read. That only holds while every half has
+		// at most one partner, with duplicated halves read from a copy.
+		RelocationTable copy;
+		if (duplicates) {
+			copy = rels;
+		}
+
+		// Every relocation written stands for a distinct input relocation, so
+		// count never passes numRels
+		auto &src = duplicates ? copy : rels;
+		auto count = 0u;
+		auto emit = [&](uint32_t offset, uint32_t symbol, uint8_t type, int32_t addend) {
+			rels.offset[count] = offset;
+			rels.symbol[count] = symbol;
+			rels.type[count] = type;
+			rels.addend[count] = addend;
+			++count;
+		};
+
+		for (auto i = 0u; i < numRels; ++i) {
+			auto symbol = src.symbol[i];
+			auto type = src.type[i];
+			auto addend = src.addend[i];
+			auto offset = src.offset[i];
+			
+			// Skip halves already merged into a R_PPC_REL32
+			if (consumed[i])
+				continue;
+
+			if (!symbol && !type && !addend && !offset)
+				continue;
+
+			switch (type) {
+			case elf::R_PPC_NONE:
+			case elf::R_PPC_ADDR32:
+			case elf::R_PPC_ADDR16_LO:
+			case elf::R_PPC_ADDR16_HI:
+			case elf::R_PPC_ADDR16_HA:
+			case elf::R_PPC_REL24:
+			case elf::R_PPC_REL14:
+			case elf::R_PPC_DTPMOD32:
+			case elf::R_PPC_DTPREL32:
+			case elf::R_PPC_EMB_SDA21:
+			case elf::R_PPC_EMB_RELSDA:
+			case elf::R_PPC_DIAB_SDA21_LO:
+			case elf::R_PPC_DIAB_SDA21_HI:
+			case elf::R_PPC_DIAB_SDA21_HA:
+			case elf::R_PPC_DIAB_RELSDA_LO:
+			case elf::R_PPC_DIAB_RELSDA_HI:
+			case elf::R_PPC_DIAB_RELSDA_HA:
+			{
+				// All valid relocations
+				emit(offset, symbol, type, addend);
+				++file.stats.relocationsKept;
+				break;
+			}
+			
+			/*
+			 * Convert two GHS_REL16 into a R_PPC_REL32
+			 */
+			case elf::R_PPC_GHS_REL16_HI:
+			{
+				// Attempt to find an R_PPC_GHS_REL16_LO to make a R_PPC_REL32
+				auto converted = consumeGhsRel16(ghsRelocations, consumed,
+															symbol, elf::R_PPC_GHS_REL16_LO,
+															offset + 2, addend + 2);
+
+				for (auto j = 0u; j < converted; ++j)
+					emit(offset, symbol, elf::R_PPC_REL32, addend);
+
+				file.stats.relocationsConverted += converted;
+
+				if (!converted)
+					++unmatched;
+
+				break;
+			}
+			
+			case elf::R_PPC_GHS_REL16_LO:
+			{
+				// Attempt to find an R_PPC_GHS_REL16_HI to make a R_PPC_REL32
+				auto converted = consumeGhsRel16(ghsRelocations, consumed,
+															symbol, elf::R_PPC_GHS_REL16_HI,
+															offset - 2, addend - 2);
+
+				for (auto j = 0u; j < converted; ++j)
+					emit(offset - 2, symbol, elf::R_PPC_REL32, addend - 2);
+
+				file.stats.relocationsConverted += converted;
+
+				if (!converted)
+					++unmatched;
+
+				break;
+			}
+
+			default:
+				fmt::print("Unknown relocation found!\n");
+				++file.stats.relocationsDropped;
+				break;
+			}
+		}
+
+		if (unmatched) {
+			fmt::print("Unable to fix {} unpaired GHS_REL16 relocations in {}\n", unmatched, section.name);
+		}
+
+		file.stats.relocationsDropped += unmatched;
+		rels.resize(count);
+	}
+
+	return true;
+}
+
+// Sections smaller than this are not worth compressing
+static const size_t MinCompressedSectionSize = 64;
+
+/**
+ * Returns true for sections compressOutputSections compresses.
+ *
+ * The section name table and the RPL metadata are never compressed, nor are
+ * SHF_ALLOC sections when PT_LOAD segments map them from the file.
+ */
+static bool
+isOutputSectionCompressed(const Rpl &file,
+								  uint32_t index)
+{
+	auto &section = file.sections[index];
+
+	if (!hasSectionData(section) ||
+		 index == file.header.shstrndx ||
+		 section.header.type == elf::SHT_NULL ||
+		 section.header.type == elf::SHT_RPL_CRCS ||
+		 section.header.type == elf::SHT_RPL_FILEINFO ||
+		 section.size() < MinCompressedSectionSize) {
+		return false;
+	}
+
+	if (file.compressAllSections) {
+		return !file.programHeaders || !(section.header.flags & elf::SHF_ALLOC);
+	}
+
+	return section.header.type == elf::SHT_PROGBITS && !(section.header.flags & elf::SHF_ALLOC);
+}
+
+/**
+ * Where loadSection read the contents of a section readRpl left in the
+ * input from.
+ */
+struct SectionSource
+{
+	bool compressed;
+	size_t compressedOffset;
+	size_t compressedSize;
+	size_t inflatedSize;
+	bool deferred;
+	size_t deferredOffset;
+	size_t deferredSize;
+};
+
+/**
+ * Drop the contents loadSection read for a section which readRpl left in
+ * the input, so they are read from the input again as the file is written.
+ */
+static void
+restoreUnloadedSection(Section &section,
+							  const SectionSource &source)
+{
+	if (!source.compressed && !source.deferred) {
+		return;
+	}
+
+	section.clearData();
+	std::vector<char>().swap(section.data);
+	section.compressed = source.compressed;
+	section.compressedOffset = source.compressedOffset;
+	section.compressedSize = source.compressedSize;
+	section.inflatedSize = source.inflatedSize;
+	section.deferred = source.deferred;
+	section.deferredOffset = source.deferredOffset;
+	section.deferredSize = source.deferredSize;
+}
+
+/**
+ * Compress output sections into SHF_COMPRESSED sections.
+ *
+ * The sections of a batch are compressed at once so the blocks of all of
+ * them are spread over the threads. Under a memory budget a batch is sized
+ * so the contents already held, such as the tables and the sections
+ * compressed by earlier batches, the contents it loads and its compressed
+ * streams stay within file.memoryBudget bytes. A section which does not get
+ * smaller is left as it is, its contents are dropped again if readRpl had
+ * left them in the input.
+ */
+bool
+compressOutputSections(Rpl &file,
+							  unsigned jobs)
+{
+	std::vector<uint32_t> indices;
+
+	for (auto i = 0u; i < file.sections.size(); ++i) {
+		if (isOutputSectionCompressed(file, i)) {
+			indices.push_back(i);
+		}
+	}
+
+	// Under a memory budget sections are loaded and compressed a batch at a
+	// time, each batch holds at least one section
+	for (auto first = size_t { 0 }; first < indices.size(); ) {
+		std::vector<CompressorInput> inputs;
+		std::vector<SectionSource> unloaded;
+		auto last = first;
+		auto batchSize = size_t { 0 };
+		auto resident = size_t { 0 };
+
+		if (file.memoryBudget) {
+			for (auto &section : file.sections) {
+				resident += section.data.size();
+			}
+		}
+
+		while (last < indices.size()) {
+			auto &section = file.sections[indices[last]];
+
+			// Contents which are not held yet are loaded, the compressed
+			// stream can be as large as the contents and is copied once more
+			// to go behind its Elf32_Chdr
+			auto held = !section.compressed && !section.deferred && !section.view;
+			auto needed = (held ? 0 : section.size()) + 2 * section.size();
+
+			if (file.memoryBudget && resident + batchSize + needed > file.memoryBudget) {
+				if (last > first) {
+					break;
+				}
+
+				fmt::print("Compressing section {} needs {} bytes on top of {} bytes held, over the memory budget of {} bytes\n",
+							  section.name, needed, resident, file.memoryBudget);
+				return false;
+			}
+
+			// Kept to drop the contents again if the section does not get
+			// smaller
+			unloaded.push_back({ section.compressed,
+										section.compressedOffset,
+										section.compressedSize,
+										section.inflatedSize,
+										section.deferred,
+										section.deferredOffset,
+										section.deferredSize });
+
+			if (!loadSection(file, section)) {
+				return false;
+			}
+
+			inputs.push_back({ section.bytes(), section.size() });
+			batchSize += needed;
+			++last;
+		}
+
+		auto error = std::string {};
+		std::vector<std::vector<char>> outputs;
+
+		if (!compressBuffers(inputs, outputs, file.sectionCompressor, file.sectionCompressionLevel, jobs, error)) {
+			fmt::print("Couldn't compress output sections because {}\n", error);
+			return false;
+		}
+
+		for (auto i = size_t { 0 }; i < inputs.size(); ++i) {
+			auto &section = file.sections[indices[first + i]];
+			auto compressedSize = sizeof(elf::CompressionHeader) + outputs[i].size();
+
+			if (compressedSize >= inputs[i].size) {
+				restoreUnloadedSection(section, unloaded[i]);
+				continue;
+			}
+
+			auto header = elf::CompressionHeader {};
+			header.type = file.sectionCompressor == CompressorType::Zstd ? elf::ELFCOMPRESS_ZSTD : elf::ELFCOMPRESS_ZLIB;
+			header.size = static_cast<uint32_t>(inputs[i].size);
+			header.addralign = section.header.addralign;
+
+			// Assigned rather than resized so the memory of the contents is
+			// given back
+			auto data = std::vector<char>(compressedSize);
+			std::memcpy(data.data(), &header, sizeof(header));
+			std::memcpy(data.data() + sizeof(header), outputs[i].data(), outputs[i].size());
+			std::vector<char>().swap(outputs[i]);
+			section.clearData();
+			section.data = std::move(data);
+
+			// The section now starts with the Elf32_Chdr
+			section.header.flags = section.header.flags | elf::SHF_COMPRESSED;
+			section.header.addralign = 4u;
+		}
+
+		first = last;
+	}
+
+	return true;
+}
+
+/**
+ * Pick where in the file a section goes, the order of the categories
+ * follows the one used by the official tools:
+ * - CRCs and fileinfo first
+ * - data: !(flags & SHF_EXECINSTR), flags & SHF_WRITE, flags & SHF_ALLOC
+ * - read: !(flags & SHF_EXECINSTR) || type == SHT_RPL_EXPORTS,
+ *         !(flags & SHF_WRITE), flags & SHF_ALLOC
+ * - imports, which are read sections but have the execinstr flag set
+ * - text: flags & SHF_EXECINSTR, type != SHT_RPL_EXPORTS
+ * - temp: !(flags & SHF_EXECINSTR), !(flags & SHF_ALLOC)
+ */
+static LayoutCategory
+getLayoutCategory(const Section &section)
+{
+	auto type = section.header.type;
+	auto flags = section.header.flags;
+
+	switch (type) {
+	case elf::SHT_NULL:
+	case elf::SHT_NOBITS:
+		return LayoutCategory::None;
+	case elf::SHT_RPL_CRCS:
+		return LayoutCategory::Crcs;
+	case elf::SHT_RPL_FILEINFO:
+		return LayoutCategory::FileInfo;
+	case elf::SHT_RPL_IMPORTS:
+		return LayoutCategory::Imports;
+	}
+
+	if (section.header.size == 0) {
+		return LayoutCategory::None;
+	}
+
+	if ((flags & elf::SHF_EXECINSTR) && type != elf::SHT_RPL_EXPORTS) {
+		return LayoutCategory::Text;
+	}
+
+	// Executable exports are only placed when they would be read sections
+	auto exec = (flags & elf::SHF_EXECINSTR) != 0;
+
+	if (!(flags & elf::SHF_ALLOC)) {
+		return exec ? LayoutCategory::None : LayoutCategory::Temp;
+	}
+
+	if (flags & elf::SHF_WRITE) {
+		return exec ? LayoutCategory::None : LayoutCategory::Data;
+	}
+
+	return LayoutCategory::Read;
+}
+
+/**
+ * Returns true for sections which go in a PT_LOAD segment.
+ */
+static bool
+isLoadedSection(const Section &section,
+					 LayoutCategory category)
+{
+	switch (category) {
+	case LayoutCategory::Data:
+	case LayoutCategory::Read:
+	case LayoutCategory::Imports:
+	case LayoutCategory::Text:
+		return (section.header.flags & elf::SHF_ALLOC) != 0;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Segment flags for the sections in a segment.
+ */
+static uint32_t
+getSegmentFlags(const Section &section)
+{
+	auto flags = uint32_t { elf::PF_R };
+
+	if (section.header.flags & elf::SHF_WRITE) {
+		flags |= elf::PF_W;
+	}
+
+	if (section.header.flags & elf::SHF_EXECINSTR) {
+		flags |= elf::PF_X;
+	}
+
+	return flags;
+}
+
+/**
+ * Address range and flags of a PT_LOAD segment, planned before its file
+ * offset is known.
+ */
+struct PlannedSegment
+{
+	uint32_t vaddr;
+	uint32_t fileEnd;
+	uint32_t memEnd;
+	uint32_t flags;
+};
+
+/**
+ * Give the loaded SHT_NOBITS sections a segment. A section extends a
+ * writable segment it follows in memory with less than a page in between,
+ * otherwise it gets a segment of its own. Fails when segments overlap.
+ */
+static bool
+planNoBitsSegments(const Rpl &file,
+						 std::vector<PlannedSegment> &segments)
+{
+	std::vector<const Section *> noBits;
+
+	for (auto &section : file.sections) {
+		if (section.header.type == elf::SHT_NOBITS &&
+			 (section.header.flags & elf::SHF_ALLOC) &&
+			 section.header.addr != 0 &&
+			 section.header.size != 0) {
+			noBits.push_back(&section);
+		}
+	}
+
+	std::sort(noBits.begin(), noBits.end(), [](const Section *lhs, const Section *rhs) {
+		return static_cast<uint32_t>(lhs->header.addr) < static_cast<uint32_t>(rhs->header.addr);
+	});
+
+	for (auto section : noBits) {
+		auto address = static_cast<uint32_t>(section->header.addr);
+		auto end = address + static_cast<uint32_t>(section->header.size);
+		auto segment = static_cast<PlannedSegment *>(nullptr);
+
+		if (end < address) {
+			fmt::print("Section {} does not fit in the address space\n", section->name);
+			return false;
+		}
+
+		for (auto &candidate : segments) {
+			if ((candidate.flags & elf::PF_W) &&
+				 candidate.memEnd <= address &&
+				 address - candidate.memEnd < SegmentAlignment &&
+				 (!segment || candidate.memEnd > segment->memEnd)) {
+				segment = &candidate;
+			}
+		}
+
+		if (segment) {
+			segment->memEnd = end;
+			segment->flags |= getSegmentFlags(*section);
+		} else {
+			segments.push_back({ address, address, end, getSegmentFlags(*section) });
+		}
+	}
+
+	std::vector<const PlannedSegment *> sorted;
+	for (auto &segment : segments) {
+		sorted.push_back(&segment);
+	}
+
+	std::sort(sorted.begin(), sorted.end(), [](const PlannedSegment *lhs, const PlannedSegment *rhs) {
+		return lhs->vaddr < rhs->vaddr;
+	});
+
+	for (auto i = size_t { 1 }; i < sorted.size(); ++i) {
+		if (sorted[i - 1]->memEnd > sorted[i]->vaddr) {
+			fmt::print("Segments at 0x{:08X} and 0x{:08X} overlap in memory\n", sorted[i - 1]->vaddr, sorted[i]->vaddr);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Add the PT_LOAD program header of a planned segment placed at offset.
+ */
+static void
+addProgramHeader(Layout &layout,
+					  const PlannedSegment &planned,
+					  uint32_t offset)
+{
+	auto &segment = layout.programHeaders.emplace_back();
+	segment.type = elf::PT_LOAD;
+	segment.offset = offset;
+	segment.vaddr = planned.vaddr;
+	segment.paddr = planned.vaddr;
+	segment.filesz = planned.fileEnd - planned.vaddr;
+	segment.memsz = planned.memEnd - planned.vaddr;
+	segment.flags = planned.flags;
+	segment.align = SegmentAlignment;
+}
+
+/**
+ * Calculate section file offsets.
+ *
+ * Every section is given a layout category, then the sections are sorted
+ * by category and index and laid out one after the other in a single sweep,
+ * each starting at a multiple of its addralign.
+ *
+ * With file.programHeaders set the loaded sections of a category, those
+ * with SHF_ALLOC and a non-zero address, come first sorted by address, and
+ * each run of them which is increasing and contiguous in memory becomes a
+ * PT_LOAD segment. A segment is placed at a file offset congruent to its
+ * address modulo SegmentAlignment and its sections are spaced out as they
+ * are in memory, so the segment can be mapped as it is. SHT_NOBITS sections
+ * are planned by planNoBitsSegments. Overlapping sections or segments are
+ * an error.
+ */
+bool
+calculateSectionOffsets(Rpl &file)
+{
+	auto &layout = file.layout;
+	layout = {};
+	layout.sectionHeadersOffset = file.header.shoff;
+	layout.sectionHeadersSize = static_cast<uint32_t>(file.sections.size() * sizeof(elf::SectionHeader));
+	layout.sections.reserve(file.sections.size());
+
+	for (auto i = 0u; i < file.sections.size(); ++i) {
+		auto &section = file.sections[i];
+		auto category = getLayoutCategory(section);
+
+		if (category != LayoutCategory::None) {
+			layout.sections.push_back({ i, 0, static_cast<uint32_t>(section.size()), category });
+		} else if (section.header.type == elf::SHT_NOBITS ||
+					  section.header.type == elf::SHT_NULL) {
+			section.header.offset = 0u;
+			section.clearData();
+		} else if (section.header.offset == 0) {
+			fmt::print("Failed to calculate offset for section {}\n", i);
+			return false;
+		}
+	}
+
+	auto isLoaded = [&](const LayoutEntry &entry) {
+		auto &section = file.sections[entry.index];
+		return file.programHeaders && section.header.addr != 0 && isLoadedSection(section, entry.category);
+	};
+
+	// The loaded sections of a category come first by address, then the
+	// rest in index order
+	auto sortKey = [&](const LayoutEntry &entry) {
+		auto loaded = isLoaded(entry);
+		return std::make_tuple(entry.category,
+									  loaded ? 0 : 1,
+									  loaded ? static_cast<uint32_t>(file.sections[entry.index].header.addr) : 0u,
+									  entry.index);
+	};
+
+	std::sort(layout.sections.begin(), layout.sections.end(), [&](const LayoutEntry &lhs, const LayoutEntry &rhs) {
+		return sortKey(lhs) < sortKey(rhs);
+	});
+
+	// Plan the segments before the sweep, so the size of the program header
+	// table is known. A section joins the segment of the one before it when
+	// it follows it in memory with less than a page in between.
+	std::vector<PlannedSegment> segments;
+	std::vector<char> startsSegment(layout.sections.size(), 0);
+	auto previous = static_cast<const LayoutEntry *>(nullptr);
+
+	for (auto i = size_t { 0 }; i < layout.sections.size(); ++i) {
+		auto &entry = layout.sections[i];
+
+		if (!isLoaded(entry)) {
+			previous = nullptr;
+			continue;
+		}
+
+		auto &section = file.sections[entry.index];
+		auto address = static_cast<uint32_t>(section.header.addr);
+		auto end = address + entry.size;
+
+		if (end < address) {
+			fmt::print("Section {} does not fit in the address space\n", section.name);
+			return false;
+		}
+
+		if (previous && previous->category == entry.category) {
+			auto &previousSection = file.sections[previous->index];
+			auto previousEnd = static_cast<uint32_t>(previousSection.header.addr) + previous->size;
+
+			if (address < previousEnd) {
+				fmt::print("Sections {} and {} overlap in memory\n", previousSection.name, section.name);
+				return false;
+			}
+
+			if (address - previousEnd < SegmentAlignment) {
+				auto &segment = segments.back();
+				segment.fileEnd = end;
+				segment.memEnd = end;
+				segment.flags |= getSegmentFlags(section);
+				previous = &entry;
+				continue;
+			}
+		}
+
+		startsSegment[i] = 1;
+		segments.push_back({ address, end, end, getSegmentFlags(section) });
+		previous = &entry;
+	}
+
+	if (file.programHeaders && !planNoBitsSegments(file, segments)) {
+		return false;
+	}
+
+	auto offset = layout.sectionHeadersOffset + align_up(layout.sectionHeadersSize, 64);
+
+	if (file.programHeaders) {
+		layout.programHeadersOffset = offset;
+		layout.programHeaders.reserve(segments.size());
+		offset += align_up(static_cast<uint32_t>(segments.size() * sizeof(elf::ProgramHeader)), 64);
+	}
+
+	for (auto i = size_t { 0 }; i < layout.sections.size(); ++i) {
+		auto &entry = layout.sections[i];
+		auto &section = file.sections[entry.index];
+		auto alignment = static_cast<uint32_t>(section.header.addralign);
+		auto address = static_cast<uint32_t>(section.header.addr);
+
+		if (startsSegment[i]) {
+			offset += (address - offset) & (SegmentAlignment - 1);
+			addProgramHeader(layout, segments[layout.programHeaders.size()], offset);
+		} else if (isLoaded(entry)) {
+			auto &segment = layout.programHeaders.back();
+			offset = segment.offset + (address - segment.vaddr);
+		} else if (alignment > 1 && (alignment & (alignment - 1)) == 0) {
+			offset = align_up(offset, alignment);
+		}
+
+		entry.offset = offset;
+		section.header.offset = offset;
+		section.header.size = entry.size;
+		offset += entry.size;
+	}
+
+	// Segments only holding SHT_NOBITS sections have nothing in the file
+	for (auto i = layout.programHeaders.size(); i < segments.size(); ++i) {
+		addProgramHeader(layout, segments[i], segments[i].vaddr & (SegmentAlignment - 1));
+	}
+
+	std::stable_sort(layout.programHeaders.begin(), layout.programHeaders.end(),
+						  [](const elf::ProgramHeader &lhs, const elf::ProgramHeader &rhs) {
+							  return static_cast<uint32_t>(lhs.vaddr) < static_cast<uint32_t>(rhs.vaddr);
+						  });
+
+	if (file.programHeaders) {
+		file.header.phoff = layout.programHeadersOffset;
+		file.header.phentsize = uint16_t { sizeof(elf::ProgramHeader) };
+		file.header.phnum = static_cast<uint16_t>(layout.programHeaders.size());
+	}
+
+	layout.fileSize = std::max(offset, layout.sectionHeadersOffset + layout.sectionHeadersSize);
+	return true;
+}
+
+/**
+ * Collect the pieces of the final ELF, sectionHeaders holds the big endian
+ * section header table until they are written.
+ */
+static std::vector<OutputChunk>
+getOutputChunks(Rpl &file,
+					 std::vector<elf::SectionHeader> &sectionHeaders)
+{
+	std::vector<OutputChunk> chunks;
+	sectionHeaders.reserve(file.sections.size());
+	chunks.reserve(file.sections.size() + 2);
+
+	for (const auto &section : file.sections) {
+		sectionHeaders.push_back(section.header);
+	}
+
+	// File header, section headers and then the sections in layout order
+	chunks.push_back({ 0, reinterpret_cast<const char *>(&file.header), sizeof(elf::Header) });
+	chunks.push_back({ file.header.shoff,
+							 reinterpret_cast<const char *>(sectionHeaders.data()),
+							 sectionHeaders.size() * sizeof(elf::SectionHeader) });
+	chunks.push_back({ file.layout.programHeadersOffset,
+							 reinterpret_cast<const char *>(file.layout.programHeaders.data()),
+							 file.layout.programHeaders.size() * sizeof(elf::ProgramHeader) });
+
+	for (const auto &entry : file.layout.sections) {
+		const auto &section = file.sections[entry.index];
+
+		if (section.deferred) {
+			auto chunk = OutputChunk { entry.offset, nullptr, section.size() };
+			chunk.produce = [&file, index = entry.index](const OutputChunk::Writer &write, std::string &error) {
+				return readDeferredSection(file.input, file.sections[index], write, error);
+			};
+			chunks.push_back(std::move(chunk));
+			continue;
+		}
+
+		if (!section.compressed) {
+			chunks.push_back({ entry.offset, section.bytes(), section.size() });
+			continue;
+		}
+
+		// Sections nothing needed to look at are inflated straight into the
+		// output instead of being held in memory
+		if (!file.decompressor) {
+			file.decompressor = createDecompressor(file.decompressorType);
+		}
+
+		auto chunk = OutputChunk { entry.offset, nullptr, section.size() };
+		chunk.produce = [&file, index = entry.index](const OutputChunk::Writer &write, std::string &error) {
+			auto &section = file.sections[index];
+			return file.decompressor->decompressStream(file.input,
+																	 section.compressedOffset,
+																	 section.compressedSize,
+																	 section.inflatedSize,
+																	 write,
+																	 error);
+		};
+		chunks.push_back(std::move(chunk));
+	}
+
+	return chunks;
+}
+
+/**
+ * Write out the final ELF.
+ */
+bool
+writeElf(Rpl &file, const std::string &filename)
+{
+	std::vector<elf::SectionHeader> sectionHeaders;
+	auto chunks = getOutputChunks(file, sectionHeaders);
+
+	auto error = std::string {};
+	if (!writeOutputFile(filename, std::move(chunks), file.layout.fileSize, error)) {
+		fmt::print("Could not write {}: {}\n", filename, error);
+		return false;
+	}
+
+	file.stats.bytesWritten = file.layout.fileSize;
+
+	return true;
+}
+
+/**
+ * Write out the final ELF into memory.
+ */
+bool
+writeElf(Rpl &file, std::vector<char> &output)
+{
+	std::vector<elf::SectionHeader> sectionHeaders;
+	auto chunks = getOutputChunks(file, sectionHeaders);
+
+	auto error = std::string {};
+	if (!writeOutputBuffer(std::move(chunks), file.layout.fileSize, output, error)) {
+		fmt::print("Could not write the output: {}\n", error);
+		return false;
+	}
+
+	file.stats.bytesWritten = output.size();
+
+	return true;
+}
+
+/**
+ * Write out the final ELF to a stream which cannot seek.
+ */
+bool
+writeElf(Rpl &file, std::FILE *output)
+{
+	std::vector<elf::SectionHeader> sectionHeaders;
+	auto chunks = getOutputChunks(file, sectionHeaders);
+
+	auto error = std::string {};
+	if (!writeOutputStream(output, std::move(chunks), file.layout.fileSize, error)) {
+		fmt::print("Could not write the output: {}\n", error);
+		return false;
+	}
+
+	file.stats.bytesWritten = file.layout.fileSize;
+
+	return true;
+}
+
+/**
+ * A section being moved to a new address.
+ */
+struct SectionMove
+{
+	uint64_t start;
+	uint64_t end;
+	uint32_t newAddress;
+	uint32_t index;
+};
+
+/**
+ * Address lookup over a set of section moves.
+ *
+ * Moves are applied in section index order, and a value moved by one
+ * section may land in the old range of a later one. find() returns the
+ * first move after a given one whose range contains the value, so
+ * applying moves until it returns nullptr gives the same result as
+ * relocating every section one after the other.
+ */
+class SectionMoveIndex
+{
+public:
+	SectionMoveIndex(std::vector<SectionMove> moves) :
+		mMoves(std::move(moves))
+	{
+		std::sort(mMoves.begin(), mMoves.end(), [](const SectionMove &lhs, const SectionMove &rhs) {
+			return lhs.start < rhs.start;
+		});
+
+		// Running maximum of the range ends, so the backwards search below
+		// can stop as soon as no earlier range can reach the value
+		auto maxEnd = uint64_t { 0 };
+		for (auto &move : mMoves) {
+			maxEnd = std::max(maxEnd, move.end);
+			mMaxEnd.push_back(maxEnd);
+		}
+	}
+
+	const SectionMove *
+	find(uint32_t value, const SectionMove *after) const
+	{
+		const SectionMove *result = nullptr;
+		auto itr = std::upper_bound(mMoves.begin(), mMoves.end(), value, [](uint64_t value, const SectionMove &move) {
+			return value < move.start;
+		});
+
+		for (auto i = static_cast<size_t>(itr - mMoves.begin()); i > 0 && mMaxEnd[i - 1] >= value; --i) {
+			auto &move = mMoves[i - 1];
+
+			if (value > move.end || (after && move.index <= after->index)) {
+				continue;
+			}
+
+			if (!result || move.index < result->index) {
+				result = &move;
+			}
+		}
+
+		return result;
+	}
+
+private:
+	std::vector<SectionMove> mMoves;
+	std::vector<uint64_t> mMaxEnd;
+};
+
+/**
+ * Relocate the import sections to be in loader memory.
+ *
+ * All the section moves are planned first, then every symbol and
+ * relocation is relocated in a single pass with a lookup per entry.
+ */
+bool
+relocateImports(Rpl &file)
+{
+	auto newLoc = file.importsAddress;
+	std::vector<SectionMove> moves;
+
+	for (auto i = 0u; i < file.sections.size(); ++i) {
+		auto &section = file.sections[i];
+		if (section.header.type == elf::SHT_RPL_IMPORTS) {
+			auto sectionSize = section.size() ? section.size() : static_cast<size_t>(section.header.size);
+			auto oldSectionAddress = section.header.addr;
+
+			moves.push_back({ oldSectionAddress,
+									oldSectionAddress + sectionSize,
+									static_cast<uint32_t>(align_up(newLoc, section.header.addralign)),
+									i });
+			newLoc = moves.back().newAddress + static_cast<uint32_t>(sectionSize);
+		}
+	}
+
+	if (moves.empty()) {
+		return true;
+	}
+
+	auto moveIndex = SectionMoveIndex { moves };
+	std::vector<const SectionMove *> sectionMoves(file.sections.size(), nullptr);
+
+	for (auto &move : moves) {
+		sectionMoves[move.index] = &move;
+	}
+
+	// Relocate symbols pointing into the moved sections
+	for (auto &symSection : file.sections) {
+		if (symSection.header.type != elf::SectionType::SHT_SYMTAB) {
+			continue;
+		}
+
+		auto &symbols = symSection.symbols;
+		for (auto i = 0u; i < symbols.count(); ++i) {
+			auto type = symbols.info[i] & 0xf;
+			auto value = symbols.value[i];
+
+			// Only relocate data, func, section symbols
+			if (type != elf::STT_OBJECT &&
+				 type != elf::STT_FUNC &&
+				 type != elf::STT_SECTION) {
+				continue;
+			}
+
+			auto move = moveIndex.find(value, nullptr);
+			if (!move) {
+				continue;
+			}
+
+			while (move) {
+				value = (value - static_cast<uint32_t>(move->start)) + move->newAddress;
+				move = moveIndex.find(value, move);
+			}
+
+			symbols.value[i] = value;
+			++file.stats.symbolsRelocated;
+		}
+	}
+
+	// Relocate relocations pointing into the moved sections
+	for (auto &relaSection : file.sections) {
+		if (relaSection.header.type != elf::SectionType::SHT_RELA ||
+			 relaSection.header.info >= sectionMoves.size() ||
+			 !sectionMoves[relaSection.header.info]) {
+			continue;
+		}
+
+		auto move = sectionMoves[relaSection.header.info];
+		for (auto &offset : relaSection.relocations.offset) {
+			if (offset >= move->start && offset <= move->end) {
+				offset = (offset - static_cast<uint32_t>(move->start)) + move->newAddress;
+			}
+		}
+	}
+
+	for (auto &move : moves) {
+		auto &section = file.sections[move.index];
+		section.header.addr = move.newAddress;
+		section.header.flags |= elf::SHF_ALLOC;
+	}
+
+	return true;
+}
+
+/**
+ * Returns true for sections whose only use is debugging.
+ */
+static bool
+isDebugSection(const Section &section)
+{
+	if (section.header.flags & elf::SHF_ALLOC) {
+		return false;
+	}
+
+	return section.name.compare(0, 6, ".debug") == 0 || section.name == ".line";
+}
+
+/**
+ * Remove the sections selected by file.strip.
+ */
+bool
+stripSections(Rpl &file)
+{
+	auto numSections = file.sections.size();
+	std::vector<char> removed(numSections, 0);
+
+	if (file.header.shstrndx >= numSections) {
+		fmt::print("Section name table {} is not one of the {} sections\n",
+					  static_cast<uint16_t>(file.header.shstrndx), numSections);
+		return false;
+	}
+
+	for (auto i = 1u; i < numSections; ++i) {
+		auto &section = file.sections[i];
+		auto type = section.header.type;
+
+		if (i == file.header.shstrndx) {
+			continue;
+		}
+
+		if ((file.strip & StripDebug) && isDebugSection(section)) {
+			removed[i] = 1;
+		} else if ((file.strip & StripRplMetadata) &&
+					  (type == elf::SHT_RPL_CRCS || type == elf::SHT_RPL_FILEINFO)) {
+			removed[i] = 1;
+		} else if ((file.strip & StripEmpty) && type == elf::SHT_NULL) {
+			removed[i] = 1;
+		}
+	}
+
+	// Relocations of a removed section go with it
+	for (auto i = 1u; i < numSections; ++i) {
+		auto &header = file.sections[i].header;
+
+		if (header.type == elf::SHT_RELA && header.info < numSections && removed[header.info]) {
+			removed[i] = 1;
+		}
+	}
+
+	// Empty sections are only removed when no symbol or section header refers
+	// to them
+	if (file.strip & StripEmpty) {
+		std::vector<char> referenced(numSections, 0);
+		referenced[0] = 1;
+		referenced[file.header.shstrndx] = 1;
+
+		for (auto i = 0u; i < numSections; ++i) {
+			auto &section = file.sections[i];
+
+			if (removed[i]) {
+				continue;
+			}
+
+			if (section.header.link < numSections) {
+				referenced[section.header.link] = 1;
+			}
+
+			if (section.header.type == elf::SHT_RELA && section.header.info < numSections) {
+				referenced[section.header.info] = 1;
+			}
+
+			for (auto shndx : section.symbols.shndx) {
+				if (shndx < numSections) {
+					referenced[shndx] = 1;
+				}
+			}
+		}
+
+		for (auto i = 1u; i < numSections; ++i) {
+			if (!referenced[i] && file.sections[i].header.size == 0) {
+				removed[i] = 1;
+			}
+		}
+	}
+
+	// New index of every section, 0 for the removed ones
+	std::vector<uint32_t> newIndex(numSections, 0);
+	auto count = 0u;
+
+	for (auto i = 0u; i < numSections; ++i) {
+		if (!removed[i]) {
+			newIndex[i] = count++;
+		}
+	}
+
+	if (count == numSections) {
+		return true;
+	}
+
+	// Sections which are kept must not refer to one which is not
+	auto checkReference = [&](const Section &section, uint32_t index, const char *field) {
+		if (index >= numSections) {
+			fmt::print("Section {} {} {} is not one of the {} sections\n", section.name, field, index, numSections);
+			return false;
+		}
+
+		if (removed[index]) {
+			fmt::print("Section {} {} refers to {}, which is stripped\n", section.name, field, file.sections[index].name);
+			return false;
+		}
+
+		return true;
+	};
+
+	for (auto i = 0u; i < numSections; ++i) {
+		auto &section = file.sections[i];
+
+		if (removed[i]) {
+			continue;
+		}
+
+		if (!checkReference(section, section.header.link, "link") ||
+			 (section.header.type == elf::SHT_RELA && !checkReference(section, section.header.info, "info"))) {
+			return false;
+		}
+	}
+
+	// Symbols defined in a removed section go with it, the relocations using
+	// the symbol table are renumbered to match. A relocation which is kept
+	// but uses one of those symbols cannot be converted.
+	for (auto i = 0u; i < numSections; ++i) {
+		auto &symtab = file.sections[i];
+		auto &symbols = symtab.symbols;
+
+		if (removed[i] || symtab.header.type != elf::SHT_SYMTAB) {
+			continue;
+		}
+
+		std::vector<uint32_t> newSymbol(symbols.count(), UINT32_MAX);
+		auto numSymbols = 0u;
+		auto numLocals = 0u;
+
+		for (auto index = 0u; index < symbols.count(); ++index) {
+			auto shndx = symbols.shndx[index];
+
+			// Reserved indices such as SHN_ABS are kept
+			if (shndx != elf::SHN_UNDEF && shndx < elf::SHN_LORESERVE) {
+				if (shndx >= numSections) {
+					fmt::print("Symbol {} in {} is in section {}, which is not one of the {} sections\n",
+								  index, symtab.name, shndx, numSections);
+					return false;
+				}
+
+				if (removed[shndx]) {
+					continue;
+				}
+
+				symbols.shndx[numSymbols] = static_cast<uint16_t>(newIndex[shndx]);
+			} else {
+				symbols.shndx[numSymbols] = shndx;
+			}
+
+			symbols.name[numSymbols] = symbols.name[index];
+			symbols.value[numSymbols] = symbols.value[index];
+			symbols.size[numSymbols] = symbols.size[index];
+			symbols.info[numSymbols] = symbols.info[index];
+			symbols.other[numSymbols] = symbols.other[index];
+			newSymbol[index] = numSymbols++;
+
+			if (index < static_cast<uint32_t>(symtab.header.info)) {
+				++numLocals;
+			}
+		}
+
+		if (numSymbols == symbols.count()) {
+			continue;
+		}
+
+		symbols.resize(numSymbols);
+		symtab.header.info = numLocals;
+
+		for (auto j = 0u; j < numSections; ++j) {
+			auto &rela = file.sections[j];
+			auto &rels = rela.relocations;
+
+			if (removed[j] || rela.header.type != elf::SHT_RELA || rela.header.link != i) {
+				continue;
+			}
+
+			for (auto k = size_t { 0 }; k < rels.count(); ++k) {
+				auto symbol = rels.symbol[k];
+
+				if (symbol >= newSymbol.size()) {
+					fmt::print("Relocation at 0x{:08X} in {} refers to symbol {}, which is not in {}\n",
+								  rels.offset[k], rela.name, symbol, symtab.name);
+					return false;
+				}
+
+				if (newSymbol[symbol] == UINT32_MAX) {
+					fmt::print("Relocation at 0x{:08X} in {} refers to symbol {}, which is in a stripped section\n",
+								  rels.offset[k], rela.name, symbol);
+					return false;
+				}
+
+				rels.symbol[k] = newSymbol[symbol];
+			}
+		}
+	}
+
+	for (auto i = 0u; i < numSections; ++i) {
+		auto &section = file.sections[i];
+
+		if (removed[i]) {
+			continue;
+		}
+
+		section.header.link = newIndex[section.header.link];
+
+		if (section.header.type == elf::SHT_RELA) {
+			section.header.info = newIndex[section.header.info];
+		}
+	}
+
+	file.header.shstrndx = static_cast<uint16_t>(newIndex[file.header.shstrndx]);
+
+	// The CRC table has an entry per section index, keep those of the
+	// sections which are left
+	for (auto i = 0u; i < numSections; ++i) {
+		auto &crcs = file.sections[i];
+
+		if (removed[i] || crcs.header.type != elf::SHT_RPL_CRCS) {
+			continue;
+		}
+
+		if (!loadSection(file, crcs)) {
+			return false;
+		}
+
+		auto &data = crcs.mutableData();
+		auto numCrcs = data.size() / sizeof(elf::RplCrc);
+		auto kept = size_t { 0 };
+
+		for (auto index = size_t { 0 }; index < numCrcs; ++index) {
+			if (index >= numSections || !removed[index]) {
+				std::memmove(data.data() + kept * sizeof(elf::RplCrc),
+								 data.data() + index * sizeof(elf::RplCrc),
+								 sizeof(elf::RplCrc));
+				++kept;
+			}
+		}
+
+		data.resize(kept * sizeof(elf::RplCrc));
+	}
+
+	auto next = 0u;
+	for (auto i = 0u; i < numSections; ++i) {
+		if (!removed[i]) {
+			if (next != i) {
+				file.sections[next] = std::move(file.sections[i]);
+			}
+
+			++next;
+		}
+	}
+
+	file.sections.resize(count);
+	file.header.shnum = static_cast<uint16_t>(count);
+	return true;
+}
@@ -0,0 +1,496 @@
+#include "server.h"
+#include "utils.h"
+#include <fmt/format.h>
+
+#ifdef PLATFORM_POSIX
+#include <cerrno>
+#include <cstdio>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Bumped whenever ServerRequest or ServerReply change
+static const uint32_t ServerProtocolVersion = 5;
+
+// Sent along with the input and output descriptors
+struct ServerRequest
+{
+   uint32_t version;
+   uint32_t importsAddress;
+   uint32_t programHeaders;
+   uint32_t strip;
+
+   // CompressorType + 1 when compressing sections, 0 when not
+   uint32_t sectionCompressor;
+   uint32_t compressAllSections;
+   int32_t sectionCompressionLevel;
+   uint32_t verify;
+   uint32_t decompressorType;
+   uint64_t memoryBudget;
+};
+
+struct ServerReply
+{
+   uint32_t converted;
+};
+
+static bool
+getSocketAddress(const std::string &socketPath,
+                 sockaddr_un &address)
+{
+   address = sockaddr_un {};
+   address.sun_family = AF_UNIX;
+
+   if (socketPath.size() >= sizeof(address.sun_path)) {
+      fmt::print("Socket path {} is too long\n", socketPath);
+      return false;
+   }
+
+   std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+   return true;
+}
+
+static bool
+sendAll(int fd,
+        const void *data,
+        size_t size)
+{
+   auto bytes = reinterpret_cast<const char *>(data);
+
+   while (size) {
+      auto sent = send(fd, bytes, size, MSG_NOSIGNAL);
+
+      if (sent < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+
+         return false;
+      }
+
+      bytes += sent;
+      size -= static_cast<size_t>(sent);
+   }
+
+   return true;
+}
+
+static bool
+receiveAll(int fd,
+           void *data,
+           size_t size)
+{
+   auto bytes = reinterpret_cast<char *>(data);
+
+   while (size) {
+      auto received = recv(fd, bytes, size, 0);
+
+      if (received < 0 && errno == EINTR) {
+         continue;
+      }
+
+      if (received <= 0) {
+         return false;
+      }
+
+      bytes += received;
+      size -= static_cast<size_t>(received);
+   }
+
+   return true;
+}
+
+// Receive a request and the two descriptors sent with it, returns false
+// once the client has nothing more to send
+static bool
+receiveRequest(int connection,
+               ServerRequest &request,
+               int (&fds)[2])
+{
+   char control[CMSG_SPACE(sizeof(fds))];
+   auto data = iovec { &request, sizeof(request) };
+   auto message = msghdr {};
+   message.msg_iov = &data;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = sizeof(control);
+
+   auto received = ssize_t { 0 };
+   do {
+      received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+   } while (received < 0 && errno == EINTR);
+
+   fds[0] = fds[1] = -1;
+
+   for (auto header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+      if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS &&
+          header->cmsg_len == CMSG_LEN(sizeof(fds))) {
+         std::memcpy(fds, CMSG_DATA(header), sizeof(fds));
+      }
+   }
+
+   // The descriptors arrive with the first byte, the rest of the request
+   // may follow separately
+   if (received > 0 && static_cast<size_t>(received) < sizeof(request)) {
+      auto rest = reinterpret_cast<char *>(&request) + received;
+      received = receiveAll(connection, rest, sizeof(request) - received) ? sizeof(request) : -1;
+   }
+
+   if (received != sizeof(request) || fds[0] < 0 || fds[1] < 0) {
+      for (auto fd : fds) {
+         if (fd >= 0) {
+            close(fd);
+         }
+      }
+
+      return false;
+   }
+
+   return true;
+}
+
+// Read the whole input into buffer. Regular files are read as well instead
+// of being mapped, a client truncating its file would otherwise bring the
+// server down with SIGBUS.
+static bool
+readDescriptor(int fd,
+               std::vector<char> &buffer)
+{
+   const auto BlockSize = size_t { 1024 * 1024 };
+   auto size = size_t { 0 };
+
+   struct stat st;
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      buffer.reserve(static_cast<size_t>(st.st_size) + BlockSize);
+   }
+
+   while (true) {
+      buffer.resize(size + BlockSize);
+      auto result = read(fd, buffer.data() + size, BlockSize);
+
+      if (result < 0 && errno == EINTR) {
+         continue;
+      }
+
+      if (result < 0) {
+         return false;
+      }
+
+      if (result == 0) {
+         break;
+      }
+
+      size += static_cast<size_t>(result);
+   }
+
+   buffer.resize(size);
+   return true;
+}
+
+static bool
+isCompressorAvailable(CompressorType type)
+{
+   for (auto &name : availableCompressors()) {
+      auto available = CompressorType {};
+
+      if (parseCompressorType(name, available) && available == type) {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+// Check the options a client sent before converting with them
+static bool
+checkRequest(const ServerRequest &request)
+{
+   if (request.sectionCompressor) {
+      auto type = static_cast<CompressorType>(request.sectionCompressor - 1);
+
+      if (!isCompressorAvailable(type)) {
+         fmt::print("Rejecting request for section compressor {}, it is not available in this build\n",
+                    request.sectionCompressor - 1);
+         return false;
+      }
+
+      // zlib levels go up to 9, zstd ones up to 22
+      auto maxLevel = type == CompressorType::Zstd ? 22 : 9;
+
+      if (request.sectionCompressionLevel < 0 || request.sectionCompressionLevel > maxLevel) {
+         fmt::print("Rejecting request for compression level {}\n", request.sectionCompressionLevel);
+         return false;
+      }
+   }
+
+   if (!createDecompressor(static_cast<DecompressorType>(request.decompressorType))) {
+      fmt::print("Rejecting request for decompressor {}, it is not available in this build\n",
+                 request.decompressorType);
+      return false;
+   }
+
+   return true;
+}
+
+// Handle every request sent on one connection
+static void
+serveConnection(int connection,
+                const ConverterOptions &serverOptions,
+                std::vector<char> &buffer)
+{
+   auto request = ServerRequest {};
+   int fds[2];
+
+   while (receiveRequest(connection, request, fds)) {
+      auto reply = ServerReply { 0 };
+
+      if (request.version != ServerProtocolVersion) {
+         fmt::print("Ignoring request with protocol version {}\n", request.version);
+      } else if (checkRequest(request)) {
+         auto options = serverOptions;
+         options.importsAddress = request.importsAddress;
+         options.programHeaders = request.programHeaders != 0;
+         options.strip = request.strip;
+         options.compressSections = request.sectionCompressor != 0;
+         options.compressAllSections = request.compressAllSections != 0;
+         options.sectionCompressor = static_cast<CompressorType>(request.sectionCompressor ? request.sectionCompressor - 1 : 0);
+         options.sectionCompressionLevel = request.sectionCompressionLevel;
+         options.verify = request.verify != 0;
+         options.decompressorType = static_cast<DecompressorType>(request.decompressorType);
+         options.memoryBudget = static_cast<size_t>(request.memoryBudget);
+
+         auto output = fdopen(fds[1], "wb");
+
+         if (!readDescriptor(fds[0], buffer)) {
+            fmt::print("Could not read the input: {}\n", std::strerror(errno));
+         } else if (!output) {
+            fmt::print("Could not open the output: {}\n", std::strerror(errno));
+         } else {
+            auto converter = Converter { options };
+            reply.converted = converter.convert(buffer.data(), buffer.size(), output);
+         }
+
+         if (output) {
+            // fclose closes fds[1]
+            if (std::fclose(output) != 0) {
+               reply.converted = 0;
+            }
+
+            fds[1] = -1;
+         }
+
+         // Keep the largest input buffer around for the next request
+         buffer.clear();
+      }
+
+      for (auto fd : fds) {
+         if (fd >= 0) {
+            close(fd);
+         }
+      }
+
+      if (!sendAll(connection, &reply, sizeof(reply))) {
+         break;
+      }
+   }
+
+   close(connection);
+}
+
+bool
+runServer(const std::string &socketPath,
+          const ConverterOptions &options,
+          unsigned jobs)
+{
+   sockaddr_un address;
+   if (!getSocketAddress(socketPath, address)) {
+      return false;
+   }
+
+   auto listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (listener < 0) {
+      fmt::print("Could not create socket: {}\n", std::strerror(errno));
+      return false;
+   }
+
+   // A socket left behind by an earlier server is replaced
+   unlink(socketPath.c_str());
+
+   if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+       listen(listener, SOMAXCONN) != 0) {
+      fmt::print("Could not listen on {}: {}\n", socketPath, std::strerror(errno));
+      close(listener);
+      return false;
+   }
+
+   // A client going away must not kill the server
+   signal(SIGPIPE, SIG_IGN);
+
+   // Connections are queued for a fixed set of workers which stay up for the
+   // life of the server, each keeps its own input buffer between requests
+   std::mutex mutex;
+   std::condition_variable pending;
+   std::deque<int> connections;
+   std::vector<std::thread> workers;
+   auto stopping = false;
+
+   for (auto i = 0u; i < std::max(1u, jobs); ++i) {
+      workers.emplace_back([&]() {
+         std::vector<char> buffer;
+
+         while (true) {
+            auto connection = -1;
+
+            {
+               std::unique_lock<std::mutex> lock { mutex };
+               pending.wait(lock, [&]() { return stopping || !connections.empty(); });
+
+               if (connections.empty()) {
+                  return;
+               }
+
+               connection = connections.front();
+               connections.pop_front();
+            }
+
+            serveConnection(connection, options, buffer);
+         }
+      });
+   }
+
+   // The log is flushed a line at a time, the server is usually stopped
+   // with a signal
+   std::setvbuf(stdout, nullptr, _IOLBF, 0);
+   fmt::print("Listening on {} with {} workers\n", socketPath, workers.size());
+
+   while (true) {
+      auto connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+
+      if (connection < 0) {
+         if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+            continue;
+         }
+
+         fmt::print("Could not accept connections on {}: {}\n", socketPath, std::strerror(errno));
+         break;
+      }
+
+      std::lock_guard<std::mutex> lock { mutex };
+      connections.push_back(connection);
+      pending.notify_one();
+   }
+
+   // Let the workers finish the connections already accepted
+   {
+      std::lock_guard<std::mutex> lock { mutex };
+      stopping = true;
+      pending.notify_all();
+   }
+
+   for (auto &worker : workers) {
+      worker.join();
+   }
+
+   close(listener);
+   return false;
+}
+
+RemoteResult
+convertRemote(const std::string &socketPath,
+              int input,
+              int output,
+              const ConverterOptions &options)
+{
+   sockaddr_un address;
+   if (!getSocketAddress(socketPath, address)) {
+      return RemoteResult::Unavailable;
+   }
+
+   auto connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (connection < 0) {
+      return RemoteResult::Unavailable;
+   }
+
+   if (connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+      close(connection);
+      return RemoteResult::Unavailable;
+   }
+
+   auto request = ServerRequest {
+      ServerProtocolVersion,
+      options.importsAddress,
+      options.programHeaders,
+      options.strip,
+      options.compressSections ? static_cast<uint32_t>(options.sectionCompressor) + 1 : 0u,
+      options.compressAllSections,
+      options.sectionCompressionLevel,
+      options.verify,
+      static_cast<uint32_t>(options.decompressorType),
+      options.memoryBudget,
+   };
+   int fds[2] = { input, output };
+   char control[CMSG_SPACE(sizeof(fds))] = { };
+   auto data = iovec { &request, sizeof(request) };
+   auto message = msghdr {};
+   message.msg_iov = &data;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = sizeof(control);
+
+   auto header = CMSG_FIRSTHDR(&message);
+   header->cmsg_level = SOL_SOCKET;
+   header->cmsg_type = SCM_RIGHTS;
+   header->cmsg_len = CMSG_LEN(sizeof(fds));
+   std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+   auto sent = ssize_t { 0 };
+   do {
+      sent = sendmsg(connection, &message, MSG_NOSIGNAL);
+   } while (sent < 0 && errno == EINTR);
+
+   // Nothing was converted if the request did not get through whole
+   if (sent < 0 ||
+       (static_cast<size_t>(sent) < sizeof(request) &&
+        !sendAll(connection, reinterpret_cast<char *>(&request) + sent, sizeof(request) - sent))) {
+      close(connection);
+      return RemoteResult::Unavailable;
+   }
+
+   auto reply = ServerReply {};
+   auto received = receiveAll(connection, &reply, sizeof(reply));
+   close(connection);
+
+   if (!received) {
+      fmt::print("Server on {} closed the connection\n", socketPath);
+      return RemoteResult::Failed;
+   }
+
+   return reply.converted ? RemoteResult::Converted : RemoteResult::Failed;
+}
+#else
+bool
+runServer(const std::string &socketPath,
+          const ConverterOptions &,
+          unsigned)
+{
+   fmt::print("Cannot serve on {}, servers are only supported on POSIX systems\n", socketPath);
+   return false;
+}
+
+RemoteResult
+convertRemote(const std::string &,
+              int,
+              int,
+              const ConverterOptions &)
+{
+   return RemoteResult::Unavailable;
+}
+#endif
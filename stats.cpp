@@ -0,0 +1,131 @@
+#include "stats.h"
+#include "utils.h"
+#include <fmt/format.h>
+
+#ifdef PLATFORM_POSIX
+#include <sys/resource.h>
+#endif
+
+uint64_t
+getPeakRss()
+{
+#ifdef PLATFORM_POSIX
+   struct rusage usage;
+   if (getrusage(RUSAGE_SELF, &usage) != 0) {
+      return 0;
+   }
+
+#ifdef PLATFORM_APPLE
+   return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+   // Linux reports kilobytes
+   return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+   return 0;
+#endif
+}
+
+bool
+parseStatsFormat(const std::string &name,
+                 StatsFormat &format)
+{
+   if (name == "text") {
+      format = StatsFormat::Text;
+   } else if (name == "json") {
+      format = StatsFormat::Json;
+   } else {
+      return false;
+   }
+
+   return true;
+}
+
+static std::string
+escapeJson(const std::string &value)
+{
+   std::string result;
+   result.reserve(value.size());
+
+   for (auto c : value) {
+      switch (c) {
+      case '"':
+         result += "\\\"";
+         break;
+      case '\\':
+         result += "\\\\";
+         break;
+      case '\n':
+         result += "\\n";
+         break;
+      case '\t':
+         result += "\\t";
+         break;
+      default:
+         if (static_cast<unsigned char>(c) < 0x20) {
+            result += fmt::format("\\u{:04x}", static_cast<unsigned>(c));
+         } else {
+            result += c;
+         }
+      }
+   }
+
+   return result;
+}
+
+static std::string
+formatText(const std::string &path,
+           const ConvertStats &stats)
+{
+   auto total = 0.0;
+   auto out = fmt::format("Stats for {}\n", path);
+   out += fmt::format("  {:<24} {:>12} {:>16}\n", "stage", "time (ms)", "peak RSS (KiB)");
+
+   for (auto &stage : stats.stages) {
+      out += fmt::format("  {:<24} {:>12.3f} {:>16}\n", stage.name, stage.milliseconds, stage.peakRss / 1024);
+      total += stage.milliseconds;
+   }
+
+   out += fmt::format("  {:<24} {:>12.3f}\n", "total", total);
+   out += fmt::format("  bytes read:            {}\n", stats.bytesRead);
+   out += fmt::format("  bytes inflated:        {}\n", stats.bytesInflated);
+   out += fmt::format("  bytes written:         {}\n", stats.bytesWritten);
+   out += fmt::format("  relocations kept:      {}\n", stats.relocationsKept);
+   out += fmt::format("  relocations converted: {}\n", stats.relocationsConverted);
+   out += fmt::format("  relocations dropped:   {}\n", stats.relocationsDropped);
+   out += fmt::format("  symbols relocated:     {}\n", stats.symbolsRelocated);
+   return out;
+}
+
+// A single line JSON object, so batch runs produce one object per file
+static std::string
+formatJson(const std::string &path,
+           const ConvertStats &stats)
+{
+   auto out = fmt::format("{{\"file\":\"{}\",\"stages\":[", escapeJson(path));
+
+   for (auto i = size_t { 0 }; i < stats.stages.size(); ++i) {
+      auto &stage = stats.stages[i];
+      out += fmt::format("{}{{\"name\":\"{}\",\"time_ms\":{:.3f},\"peak_rss_bytes\":{}}}",
+                         i ? "," : "", stage.name, stage.milliseconds, stage.peakRss);
+   }
+
+   out += fmt::format("],\"bytes_read\":{},\"bytes_inflated\":{},\"bytes_written\":{}",
+                      stats.bytesRead, stats.bytesInflated, stats.bytesWritten);
+   out += fmt::format(",\"relocations_kept\":{},\"relocations_converted\":{},\"relocations_dropped\":{}",
+                      stats.relocationsKept, stats.relocationsConverted, stats.relocationsDropped);
+   out += fmt::format(",\"symbols_relocated\":{}}}\n", stats.symbolsRelocated);
+   return out;
+}
+
+std::string
+formatStats(const std::string &path,
+            const ConvertStats &stats,
+            StatsFormat format)
+{
+   if (format == StatsFormat::Json) {
+      return formatJson(path, stats);
+   }
+
+   return formatText(path, stats);
+}
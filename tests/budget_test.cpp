@@ -0,0 +1,95 @@
+// Converts with --compress-all-sections under a small --memory-budget and
+// checks the peak resident set size of the process grew by no more than
+// the budget and a fixed allowance for the zlib states, stdio and the
+// allocator.
+//
+// Run by ./build.sh test as budget_test <input.rpx> <work dir>. The peak
+// only ever grows, so the conversion under the budget has to be the first
+// thing the test does.
+#include "converter.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fmt/format.h>
+#include <string>
+#include <unistd.h>
+
+// Bytes each conversion may hold
+static const size_t MemoryBudget = 2 * 1024 * 1024;
+
+// Memory a conversion uses besides section contents, the code paged in
+// alone is about 1 MiB
+static const uint64_t Allowance = 1536 * 1024;
+
+/**
+ * Current resident set size. The peak is no use as the starting point, it
+ * is kept across exec and starts out as the one of the shell.
+ */
+static uint64_t
+getCurrentRss()
+{
+	auto file = std::fopen("/proc/self/statm", "r");
+	auto pages = 0ul, resident = 0ul;
+
+	if (!file) {
+		return getPeakRss();
+	}
+
+	auto read = std::fscanf(file, "%lu %lu", &pages, &resident);
+	std::fclose(file);
+	return read == 2 ? resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) : getPeakRss();
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fmt::print("{} <input.rpx> <work dir>\n", argv[0]);
+		return -1;
+	}
+
+	auto input = std::string { argv[1] };
+	auto output = std::string { argv[2] } + "/budget.elf";
+	auto startRss = getCurrentRss();
+
+	auto options = ConverterOptions {};
+	options.compressSections = true;
+	options.compressAllSections = true;
+	options.memoryBudget = MemoryBudget;
+	options.stageStats = true;
+
+	auto converter = Converter { options };
+
+	if (!converter.convert(input, output)) {
+		return -1;
+	}
+
+	auto peakRss = startRss;
+
+	for (auto &stage : converter.stats().stages) {
+		peakRss = std::max(peakRss, stage.peakRss);
+	}
+
+	if (peakRss - startRss > MemoryBudget + Allowance) {
+		fmt::print("FAIL: peak RSS grew by {} bytes under a memory budget of {} bytes\n",
+					  peakRss - startRss, MemoryBudget);
+		return -1;
+	}
+
+	// Without the budget the same conversion has to need more, or the input
+	// is too small to check anything
+	options.memoryBudget = 0;
+
+	if (!Converter { options }.convert(input, output)) {
+		return -1;
+	}
+
+	if (getPeakRss() - startRss <= MemoryBudget + Allowance) {
+		fmt::print("FAIL: {} fits in the memory budget without it, peak RSS grew by {} bytes\n",
+					  input, getPeakRss() - startRss);
+		return -1;
+	}
+
+	fmt::print("budget_test: ok\n");
+	return 0;
+}
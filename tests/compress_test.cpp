@@ -0,0 +1,186 @@
+// Converts with --compress-all-sections and checks the output can still be
+// read: section names, the RPL metadata and, with program headers, the
+// loaded sections are left uncompressed. Every compressed section has to
+// inflate to the section of a plain conversion, at several levels and with
+// several threads splitting sections into blocks.
+//
+// Run by ./build.sh test as compress_test <input.rpx> <work dir>.
+#include "converter.h"
+#include "rpl2elf.h"
+
+#include <cstring>
+#include <fmt/format.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Sections are split into blocks of this size when compressing, see
+// compressor.cpp
+static const size_t DeflateBlockSize = 128 * 1024;
+
+/**
+ * Convert input to path and read the result back.
+ */
+static bool
+convertAndRead(const std::string &input,
+					const std::string &path,
+					const ConverterOptions &options,
+					Rpl &rpl)
+{
+	if (!Converter { options }.convert(input, path)) {
+		return false;
+	}
+
+	return readElf(rpl, path, false);
+}
+
+/**
+ * Inflate every SHF_COMPRESSED section of compressed and compare it with
+ * the same section of plain. numLarge counts the sections which were
+ * split into more than one block.
+ */
+static bool
+compareContents(Rpl &plain,
+					 Rpl &compressed,
+					 const std::string &name,
+					 size_t &numLarge)
+{
+	std::vector<unsigned char> inflated;
+
+	for (auto i = 0u; i < compressed.sections.size(); ++i) {
+		auto &section = compressed.sections[i];
+		auto &expected = plain.sections[i];
+
+		if (!(section.header.flags & elf::SHF_COMPRESSED)) {
+			continue;
+		}
+
+		if (!loadSection(compressed, section) || !loadSection(plain, expected)) {
+			return false;
+		}
+
+		auto header = elf::CompressionHeader {};
+
+		if (section.size() < sizeof(header)) {
+			fmt::print("FAIL: {} section {} has no compression header\n", name, section.name);
+			return false;
+		}
+
+		std::memcpy(&header, section.bytes(), sizeof(header));
+
+		if (header.type != elf::ELFCOMPRESS_ZLIB || header.size != expected.size()) {
+			fmt::print("FAIL: {} section {} has compression type {} and size {}, expected {} and {}\n",
+						  name, section.name, static_cast<uint32_t>(header.type), static_cast<uint32_t>(header.size),
+						  static_cast<uint32_t>(elf::ELFCOMPRESS_ZLIB), expected.size());
+			return false;
+		}
+
+		// One byte more than expected so a longer stream shows up
+		auto size = uLongf { expected.size() + 1 };
+		auto sourceSize = uLong { section.size() - sizeof(header) };
+		inflated.resize(size);
+
+		auto result = uncompress2(inflated.data(), &size,
+										  reinterpret_cast<const Bytef *>(section.bytes() + sizeof(header)), &sourceSize);
+
+		if (result != Z_OK || sourceSize != section.size() - sizeof(header) || size != expected.size() ||
+			 std::memcmp(inflated.data(), expected.bytes(), size) != 0) {
+			fmt::print("FAIL: {} section {} does not inflate to the plain contents, zlib returned {}\n",
+						  name, section.name, result);
+			return false;
+		}
+
+		numLarge += expected.size() > DeflateBlockSize;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fmt::print("{} <input.rpx> <work dir>\n", argv[0]);
+		return -1;
+	}
+
+	auto input = std::string { argv[1] };
+	auto workDir = std::string { argv[2] };
+
+	auto plainOptions = ConverterOptions {};
+	auto compressOptions = ConverterOptions {};
+	compressOptions.compressSections = true;
+	compressOptions.compressAllSections = true;
+
+	auto segmentOptions = compressOptions;
+	segmentOptions.programHeaders = true;
+
+	Rpl plain, compressed, segmented;
+
+	if (!convertAndRead(input, workDir + "/compress_plain.elf", plainOptions, plain) ||
+		 !convertAndRead(input, workDir + "/compress_all.elf", compressOptions, compressed) ||
+		 !convertAndRead(input, workDir + "/compress_segments.elf", segmentOptions, segmented)) {
+		return -1;
+	}
+
+	if (compressed.sections.size() != plain.sections.size()) {
+		fmt::print("FAIL: {} sections, expected {}\n", compressed.sections.size(), plain.sections.size());
+		return -1;
+	}
+
+	auto numCompressed = 0u;
+
+	for (auto i = 0u; i < plain.sections.size(); ++i) {
+		auto &section = compressed.sections[i];
+		auto type = section.header.type;
+		auto isCompressed = (section.header.flags & elf::SHF_COMPRESSED) != 0;
+
+		if (section.name != plain.sections[i].name) {
+			fmt::print("FAIL: section {} is named \"{}\", expected \"{}\"\n", i, section.name, plain.sections[i].name);
+			return -1;
+		}
+
+		if (isCompressed && (i == compressed.header.shstrndx || type == elf::SHT_RPL_CRCS || type == elf::SHT_RPL_FILEINFO)) {
+			fmt::print("FAIL: section {} {} must not be compressed\n", i, section.name);
+			return -1;
+		}
+
+		if ((segmented.sections[i].header.flags & elf::SHF_COMPRESSED) &&
+			 (segmented.sections[i].header.flags & elf::SHF_ALLOC)) {
+			fmt::print("FAIL: loaded section {} {} is compressed with program headers\n", i, section.name);
+			return -1;
+		}
+
+		numCompressed += isCompressed;
+	}
+
+	if (!numCompressed) {
+		fmt::print("FAIL: no section was compressed\n");
+		return -1;
+	}
+
+	auto numLarge = size_t { 0 };
+
+	for (auto level : { 0, 1, 6, 9 }) {
+		for (auto jobs : { 1u, 2u, 4u }) {
+			auto options = compressOptions;
+			options.sectionCompressionLevel = level;
+			options.jobs = jobs;
+
+			auto name = fmt::format("level {} with {} jobs", level, jobs);
+			Rpl output;
+
+			if (!convertAndRead(input, workDir + "/compress_level.elf", options, output) ||
+				 !compareContents(plain, output, name, numLarge)) {
+				return -1;
+			}
+		}
+	}
+
+	if (!numLarge) {
+		fmt::print("FAIL: no section is larger than one compression block\n");
+		return -1;
+	}
+
+	fmt::print("compress_test: ok\n");
+	return 0;
+}
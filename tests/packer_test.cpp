@@ -0,0 +1,180 @@
+// Packs a converted .elf whose .text grew and checks the fileinfo of the
+// packed .rpx describes the larger section. Also checks that program
+// headers are not carried into the .rpx and that SHF_COMPRESSED sections
+// are refused.
+//
+// Run by ./build.sh test as packer_test <input.rpx> <work dir>.
+#include "converter.h"
+#include "packer.h"
+#include "rpl2elf.h"
+
+#include <algorithm>
+#include <fmt/format.h>
+#include <string>
+
+// Bytes appended to .text before packing
+static const uint32_t GrowSize = 0x10000;
+
+static Section *
+findSection(Rpl &rpl,
+				uint32_t type)
+{
+	auto itr = std::find_if(rpl.sections.begin(), rpl.sections.end(), [&](const Section &section) {
+		return section.header.type == type;
+	});
+
+	return itr == rpl.sections.end() ? nullptr : &*itr;
+}
+
+/**
+ * Read the fileinfo of the .rpx at path.
+ */
+static bool
+readFileInfo(const std::string &path,
+				 elf::RplFileInfo &info)
+{
+	Rpl rpl;
+
+	if (!readRpl(rpl, path, false, DecompressorType::Zlib, 1)) {
+		return false;
+	}
+
+	auto fileInfo = findSection(rpl, elf::SHT_RPL_FILEINFO);
+
+	if (!fileInfo || fileInfo->size() < sizeof(elf::RplFileInfo)) {
+		fmt::print("{} has no fileinfo\n", path);
+		return false;
+	}
+
+	info = *reinterpret_cast<const elf::RplFileInfo *>(fileInfo->bytes());
+	return true;
+}
+
+/**
+ * Pack a --program-headers conversion, the .rpx must have no program headers.
+ */
+static bool
+checkProgramHeaders(const std::string &input,
+						  const std::string &workDir)
+{
+	auto converted = workDir + "/packer_phdrs.elf";
+	auto packed = workDir + "/packer_phdrs.rpx";
+	auto options = ConverterOptions {};
+	options.programHeaders = true;
+
+	if (!Converter { options }.convert(input, converted) || !packRpl(converted, packed, PackOptions {})) {
+		return false;
+	}
+
+	Rpl rpl;
+
+	if (!readRpl(rpl, packed, false, DecompressorType::Zlib, 1)) {
+		return false;
+	}
+
+	if (rpl.header.phoff != 0u || rpl.header.phnum != 0u || rpl.header.phentsize != 0u) {
+		fmt::print("FAIL: packed .rpx has program headers at 0x{:X}, {} of size {}\n",
+					  static_cast<uint32_t>(rpl.header.phoff),
+					  static_cast<uint16_t>(rpl.header.phnum),
+					  static_cast<uint16_t>(rpl.header.phentsize));
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Pack a --compress-sections conversion, which has to be refused.
+ */
+static bool
+checkCompressedSections(const std::string &input,
+								const std::string &workDir)
+{
+	auto converted = workDir + "/packer_compressed.elf";
+	auto packed = workDir + "/packer_compressed.rpx";
+	auto options = ConverterOptions {};
+	options.compressSections = true;
+	options.compressAllSections = true;
+
+	if (!Converter { options }.convert(input, converted)) {
+		return false;
+	}
+
+	if (packRpl(converted, packed, PackOptions {})) {
+		fmt::print("FAIL: packed an .elf with SHF_COMPRESSED sections\n");
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fmt::print("{} <input.rpx> <work dir>\n", argv[0]);
+		return -1;
+	}
+
+	auto input = std::string { argv[1] };
+	auto converted = std::string { argv[2] } + "/packer_converted.elf";
+	auto grown = std::string { argv[2] } + "/packer_grown.elf";
+	auto packed = std::string { argv[2] } + "/packer_packed.rpx";
+
+	if (!Converter {}.convert(input, converted)) {
+		return -1;
+	}
+
+	// Append to the last .text section, whose end is the end of the region
+	Rpl rpl;
+	Section *text = nullptr;
+	auto textEnd = 0u;
+
+	if (!readElf(rpl, converted, false)) {
+		return -1;
+	}
+
+	for (auto &section : rpl.sections) {
+		uint32_t addr = section.header.addr;
+
+		if (section.name.compare(0, 5, ".text") == 0 && addr + section.size() > textEnd) {
+			text = &section;
+			textEnd = addr + static_cast<uint32_t>(section.size());
+		}
+	}
+
+	if (!text) {
+		fmt::print("{} has no .text section\n", input);
+		return -1;
+	}
+
+	text->mutableData().resize(text->size() + GrowSize);
+
+	if (!calculateSectionOffsets(rpl) || !writeElf(rpl, grown) || !packRpl(grown, packed, PackOptions {})) {
+		return -1;
+	}
+
+	auto info = elf::RplFileInfo {};
+
+	if (!readFileInfo(packed, info)) {
+		return -1;
+	}
+
+	auto expected = textEnd + GrowSize - 0x02000000u;
+
+	if (info.textSize != expected) {
+		fmt::print("FAIL: packed textSize is 0x{:X}, expected 0x{:X}\n", static_cast<uint32_t>(info.textSize), expected);
+		return -1;
+	}
+
+	if (info.textAlign < 32u || info.dataAlign < 4096u) {
+		fmt::print("FAIL: packed alignments are below the ones of the official tools\n");
+		return -1;
+	}
+
+	if (!checkProgramHeaders(input, argv[2]) || !checkCompressedSections(input, argv[2])) {
+		return -1;
+	}
+
+	fmt::print("packer_test: ok\n");
+	return 0;
+}
@@ -0,0 +1,244 @@
+// Strips a section which symbols are defined in and checks the symbols go
+// with it while the relocations left still use the same symbols, and that
+// stripping fails while a relocation which is kept uses one of them.
+//
+// Run by ./build.sh test as strip_test <input.rpx> <work dir>.
+#include "elf.h"
+#include "rpl2elf.h"
+
+#include <fmt/format.h>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using SymbolKey = std::tuple<uint32_t, uint32_t, uint8_t>;
+
+/**
+ * Read the .rpx at path with its relocations and symbols decoded.
+ */
+static bool
+readTables(const std::string &path,
+			  Rpl &rpl)
+{
+	return readRpl(rpl, path, false, DecompressorType::Zlib, 1) && decodeTables(rpl);
+}
+
+static const Section *
+findSymbolTable(const Rpl &rpl)
+{
+	for (auto &section : rpl.sections) {
+		if (section.header.type == elf::SHT_SYMTAB) {
+			return &section;
+		}
+	}
+
+	return nullptr;
+}
+
+/**
+ * Returns true if symbol of the symbol table is defined in section index.
+ */
+static bool
+isDefinedIn(const Section &symtab,
+				uint32_t symbol,
+				uint32_t index)
+{
+	return symbol < symtab.symbols.count() && symtab.symbols.shndx[symbol] == index;
+}
+
+/**
+ * Count the relocations of other sections using a symbol defined in index,
+ * removing them when drop is set.
+ */
+static size_t
+countUses(Rpl &rpl,
+			 const Section &symtab,
+			 uint32_t index,
+			 bool drop)
+{
+	auto uses = size_t { 0 };
+
+	for (auto &section : rpl.sections) {
+		auto &rels = section.relocations;
+
+		if (section.header.type != elf::SHT_RELA || section.header.info == index) {
+			continue;
+		}
+
+		auto count = size_t { 0 };
+
+		for (auto i = size_t { 0 }; i < rels.count(); ++i) {
+			if (isDefinedIn(symtab, rels.symbol[i], index)) {
+				++uses;
+
+				if (drop) {
+					continue;
+				}
+			}
+
+			rels.offset[count] = rels.offset[i];
+			rels.symbol[count] = rels.symbol[i];
+			rels.type[count] = rels.type[i];
+			rels.addend[count] = rels.addend[i];
+			++count;
+		}
+
+		rels.resize(count);
+	}
+
+	return uses;
+}
+
+/**
+ * Pick the section used by the most relocations of other sections through
+ * the symbols defined in it, and make it a debug section stripSections
+ * removes.
+ */
+static uint32_t
+markSection(Rpl &rpl)
+{
+	auto symtab = findSymbolTable(rpl);
+	auto best = 0u;
+	auto bestUses = size_t { 0 };
+
+	for (auto i = 1u; i < rpl.sections.size(); ++i) {
+		if (rpl.sections[i].header.type != elf::SHT_PROGBITS) {
+			continue;
+		}
+
+		auto uses = countUses(rpl, *symtab, i, false);
+
+		if (uses > bestUses) {
+			best = i;
+			bestUses = uses;
+		}
+	}
+
+	if (best) {
+		auto &section = rpl.sections[best];
+		section.name = ".debug_" + section.name;
+		section.header.flags = static_cast<uint32_t>(section.header.flags) & ~elf::SHF_ALLOC;
+	}
+
+	rpl.strip = StripDebug;
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fmt::print("{} <input.rpx> <work dir>\n", argv[0]);
+		return -1;
+	}
+
+	auto input = std::string { argv[1] };
+
+	// A relocation which is kept uses a symbol of the stripped section
+	{
+		Rpl rpl;
+
+		if (!readTables(input, rpl)) {
+			return -1;
+		}
+
+		if (!markSection(rpl)) {
+			fmt::print("FAIL: {} has no section used through its symbols\n", input);
+			return -1;
+		}
+
+		if (stripSections(rpl)) {
+			fmt::print("FAIL: stripped a section whose symbols are still used\n");
+			return -1;
+		}
+	}
+
+	// Without those relocations the symbols are dropped and the relocations
+	// left are renumbered
+	Rpl rpl;
+
+	if (!readTables(input, rpl)) {
+		return -1;
+	}
+
+	auto index = markSection(rpl);
+	auto symtab = findSymbolTable(rpl);
+	auto &symbols = symtab->symbols;
+	countUses(rpl, *symtab, index, true);
+
+	auto numSymbols = symbols.count();
+	auto numLocals = static_cast<uint32_t>(symtab->header.info);
+	auto numDefined = size_t { 0 };
+	auto numDefinedLocals = 0u;
+
+	for (auto i = 0u; i < numSymbols; ++i) {
+		if (isDefinedIn(*symtab, i, index)) {
+			++numDefined;
+			numDefinedLocals += i < numLocals ? 1 : 0;
+		}
+	}
+
+	// The symbol each relocation uses, in section order
+	std::vector<SymbolKey> used;
+
+	for (auto &section : rpl.sections) {
+		if (section.header.type != elf::SHT_RELA || section.header.info == index) {
+			continue;
+		}
+
+		for (auto symbol : section.relocations.symbol) {
+			used.emplace_back(symbols.name[symbol], symbols.value[symbol], symbols.info[symbol]);
+		}
+	}
+
+	auto numSections = rpl.sections.size();
+
+	if (!stripSections(rpl)) {
+		fmt::print("FAIL: could not strip a section no relocation uses\n");
+		return -1;
+	}
+
+	symtab = findSymbolTable(rpl);
+
+	if (rpl.sections.size() >= numSections ||
+		 symtab->symbols.count() != numSymbols - numDefined ||
+		 symtab->header.info != numLocals - numDefinedLocals) {
+		fmt::print("FAIL: {} symbols and {} locals left of {} and {}, {} were in the stripped section\n",
+					  symtab->symbols.count(), static_cast<uint32_t>(symtab->header.info),
+					  numSymbols, numLocals, numDefined);
+		return -1;
+	}
+
+	for (auto shndx : symtab->symbols.shndx) {
+		if (shndx < elf::SHN_LORESERVE && shndx >= rpl.sections.size()) {
+			fmt::print("FAIL: a symbol is left in section {} of {}\n", shndx, rpl.sections.size());
+			return -1;
+		}
+	}
+
+	auto next = size_t { 0 };
+
+	for (auto &section : rpl.sections) {
+		if (section.header.link >= rpl.sections.size() ||
+			 (section.header.type == elf::SHT_RELA && section.header.info >= rpl.sections.size())) {
+			fmt::print("FAIL: {} refers to a section which is not there\n", section.name);
+			return -1;
+		}
+
+		if (section.header.type != elf::SHT_RELA) {
+			continue;
+		}
+
+		for (auto symbol : section.relocations.symbol) {
+			auto &stripped = symtab->symbols;
+
+			if (symbol >= stripped.count() || next >= used.size() ||
+				 used[next++] != SymbolKey { stripped.name[symbol], stripped.value[symbol], stripped.info[symbol] }) {
+				fmt::print("FAIL: a relocation in {} uses another symbol after stripping\n", section.name);
+				return -1;
+			}
+		}
+	}
+
+	fmt::print("strip_test: ok\n");
+	return 0;
+}